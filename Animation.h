@@ -0,0 +1,137 @@
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include "FrameWriter.h"
+#include "Object.h"
+#include "Screen.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//one change applied on every frame of a segment
+class AnimationOp
+{
+public:
+	std::string name; //rotate (degrees), scale, translate, camera or look (moves viewPlane)
+	Vertex3D v;
+	AnimationOp(const std::string& n, Vertex3D vv):name(n), v(vv){}
+	~AnimationOp(){}
+};
+
+//consecutive frames that share the same per-frame changes
+class AnimationSegment
+{
+public:
+	int frames;
+	std::vector<AnimationOp> ops;
+	AnimationSegment(int n = 0):frames(n){}
+	~AnimationSegment(){}
+};
+
+//scripted camera and object motion for non-interactive rendering
+//each line of a script is "<frames> <op> <args> [<op> <args> ...]", for example
+//	90 rotate 0 2 0 camera 0 0 -0.5
+//	30 hold
+//	20 scale 1.02 translate 0 0.1 0
+//blank lines and lines starting with # are skipped
+class AnimationScript
+{
+	std::vector<AnimationSegment> segments;
+public:
+	AnimationScript(){}
+	AnimationScript(const std::string&);
+	void add(const AnimationSegment& s){ segments.push_back(s); }
+	int frames() const;
+	void apply(int, RenderObject&, Vertex3D&, Vertex3D&) const;
+	~AnimationScript(){}
+};
+
+AnimationScript::AnimationScript(const std::string& filename){
+	std::ifstream file(filename.c_str());
+	if(!file.is_open()){
+		std::cout<<"Can't open the animation script.\n";
+		throw "Can't open";
+	}
+	std::string line, op;
+	for(int number = 1; getline(file, line); number++){
+		std::istringstream linestream(line);
+		AnimationSegment segment;
+		if(!(linestream >> op) || op[0] == '#') continue; //empty lines and comments
+		linestream.clear();
+		linestream.seekg(0);
+		if(!(linestream >> segment.frames) || segment.frames < 0){
+			std::cout<<"Can't read line "<<number<<" of the animation script.\n";
+			throw "Bad script";
+		}
+		while(linestream >> op){
+			Vertex3D v;
+			if(op == "rotate" || op == "translate" || op == "camera" || op == "look")
+				linestream >> v.x >> v.y >> v.z;
+			else if(op == "scale")
+				linestream >> v.x;
+			else if(op != "hold"){
+				std::cout<<"Unknown animation step "<<op<<" on line "<<number<<".\n";
+				throw "Bad script";
+			}
+			if(linestream.fail()){
+				std::cout<<"Can't read the arguments of "<<op<<" on line "<<number<<".\n";
+				throw "Bad script";
+			}
+			segment.ops.push_back(AnimationOp(op, v));
+		}
+		segments.push_back(segment);
+	}
+	if(frames() == 0){
+		std::cout<<"The animation script has no frames.\n";
+		throw "Bad script";
+	}
+}
+
+//total number of frames of the script
+int AnimationScript::frames() const{
+	int n = 0;
+	for(unsigned int i = 0; i < segments.size(); i++)
+		n += segments[i].frames;
+	return n;
+}
+
+//applies the changes of the segment the frame belongs to
+void AnimationScript::apply(int frame, RenderObject& object, Vertex3D& cam, Vertex3D& viewPlane) const{
+	for(unsigned int i = 0; i < segments.size(); i++){
+		if(frame >= segments[i].frames){
+			frame -= segments[i].frames;
+			continue;
+		}
+		for(unsigned int k = 0; k < segments[i].ops.size(); k++){
+			const AnimationOp& op = segments[i].ops[k];
+			if(op.name == "rotate") object.rotate(RADIAN(op.v.x), RADIAN(op.v.y), RADIAN(op.v.z));
+			else if(op.name == "scale") object.scale(op.v.x);
+			else if(op.name == "translate") object.translate(op.v);
+			else if(op.name == "camera") cam = cam + op.v;
+			else if(op.name == "look") viewPlane = viewPlane + op.v;
+		}
+		return;
+	}
+}
+
+//renders every frame of the script offscreen and hands it to the writer
+void renderSequence(RenderObject& object, const AnimationScript& script, FrameWriter& writer,
+	Vertex3D cam, Vertex3D viewPlane, std::vector<LightSource>& lights, int width, int height, bool multisample = false){
+	Screen frame(width, height, true);
+	frame.setMultisample(multisample);
+	int total = script.frames();
+	for(int i = 0; i < total; i++){
+		script.apply(i, object, cam, viewPlane);
+		frame.clear();
+		object.gouraudFill(frame, cam, viewPlane, lights);
+		unsigned char* rgb = writer.acquire();
+		if(rgb == NULL) break; //the writer has failed, the remaining frames would be dropped
+		frame.readRGB(rgb);
+		writer.submit();
+	}
+	writer.close();
+}
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include "ThreadPool.h"
+#include "VertexColorHeader.h"
+#include <atomic>
+#include <vector>
+
+#define BVH_BINS 12 //candidate split planes per axis of the binned SAH build
+#define BVH_LEAF_SIZE 4 //nodes with at most this many triangles are not split
+#define BVH_PARALLEL_SPLIT 2048 //subtrees above this many triangles are built as separate jobs
+#define BVH_STACK 64 //traversal stack kept on the call stack, deeper trees use one on the heap
+
+//nearest triangle found along a ray
+class RayHit
+{
+public:
+	float t, u, v; //distance along the ray and barycentric coordinates of the hit
+	int triangle; //surface index, -1 if nothing was hit
+	RayHit():t(1e30f), u(0), v(0), triangle(-1){}
+	~RayHit(){}
+};
+
+//32 byte node of the flattened tree
+//an interior node's children are nodes leftFirst and leftFirst + 1,
+//a leaf holds triangles leftFirst .. leftFirst + count - 1 of the tree's triangle order
+struct BVHNode
+{
+	float bmin[3];
+	unsigned int leftFirst;
+	float bmax[3];
+	unsigned int count;
+};
+
+//a box waiting to be visited and the distance at which the ray enters it
+struct BVHStackEntry
+{
+	unsigned int node;
+	float t;
+};
+
+//bounding volume hierarchy over the triangles of a mesh for ray casting and picking
+//built with a binned surface area heuristic, refitted in place when the vertices move
+class BVH
+{
+	std::vector<BVHNode> nodes;
+	std::atomic<unsigned int> nodeCount;
+	unsigned int depth; //levels of the tree, the traversal stack never holds more boxes
+	std::vector<unsigned int> triIndex; //surface index of each triangle in tree order
+	std::vector<Vertex3D> tri; //v0, v1 - v0, v2 - v0 of each triangle in tree order
+	std::vector<Vertex3D> centroid;
+	void subdivide(unsigned int, TaskGroup&);
+	void fitNode(BVHNode&) const;
+	void loadTriangles(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&);
+public:
+	BVH():nodeCount(0), depth(0){}
+	bool empty() const {return nodes.empty();}
+	unsigned int size() const {return nodeCount;}
+	void build(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&);
+	void refit(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&);
+	bool intersect(const Ray&, RayHit&) const;
+	void intersect(const Ray*, RayHit*, unsigned int) const;
+	~BVH(){}
+};
+
+//copies the corners of every triangle into tree order, as origin and two edges
+void BVH::loadTriangles(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex){
+	tri.resize(3*triIndex.size());
+	ThreadPool::instance().parallelFor(0, triIndex.size(), 4096, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++){
+			const Vertex3D& s = surfaceVertex[triIndex[i]];
+			Vertex3D a = position[(int)s.x - 1];
+			tri[3*i] = a;
+			tri[3*i + 1] = position[(int)s.y - 1] - a;
+			tri[3*i + 2] = position[(int)s.z - 1] - a;
+		}
+	});
+}
+
+//bounds of the triangles of a leaf
+void BVH::fitNode(BVHNode& node) const{
+	for(int k = 0; k < 3; k++){ node.bmin[k] = 1e30f; node.bmax[k] = -1e30f; }
+	for(unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++){
+		Vertex3D corner[3] = {tri[3*i], tri[3*i] + tri[3*i + 1], tri[3*i] + tri[3*i + 2]};
+		for(int c = 0; c < 3; c++){
+			float p[3] = {corner[c].x, corner[c].y, corner[c].z};
+			for(int k = 0; k < 3; k++){
+				node.bmin[k] = MIN(node.bmin[k], p[k]);
+				node.bmax[k] = MAX(node.bmax[k], p[k]);
+			}
+		}
+	}
+}
+
+//surface area of a box, half of it as only ratios matter
+inline float halfArea(const float* lo, const float* hi){
+	float e0 = hi[0] - lo[0], e1 = hi[1] - lo[1], e2 = hi[2] - lo[2];
+	return e0 < 0 ? 0 : e0*e1 + e1*e2 + e2*e0;
+}
+
+//splits a node along the cheapest of BVH_BINS planes per axis, or leaves it as a leaf
+void BVH::subdivide(unsigned int index, TaskGroup& group){
+	BVHNode& node = nodes[index];
+	fitNode(node);
+	if(node.count <= BVH_LEAF_SIZE) return;
+
+	float cmin[3] = {1e30f, 1e30f, 1e30f}, cmax[3] = {-1e30f, -1e30f, -1e30f};
+	for(unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++){
+		float c[3] = {centroid[i].x, centroid[i].y, centroid[i].z};
+		for(int k = 0; k < 3; k++){ cmin[k] = MIN(cmin[k], c[k]); cmax[k] = MAX(cmax[k], c[k]); }
+	}
+
+	float bestCost = node.count * halfArea(node.bmin, node.bmax); //cost of staying a leaf
+	int bestAxis = -1;
+	float bestSplit = 0;
+	for(int k = 0; k < 3; k++){
+		if(cmax[k] <= cmin[k]) continue;
+		unsigned int binCount[BVH_BINS] = {0};
+		float binMin[BVH_BINS][3], binMax[BVH_BINS][3];
+		for(int b = 0; b < BVH_BINS; b++)
+			for(int j = 0; j < 3; j++){ binMin[b][j] = 1e30f; binMax[b][j] = -1e30f; }
+		float scale = BVH_BINS / (cmax[k] - cmin[k]);
+		for(unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++){
+			float c = k == 0 ? centroid[i].x : (k == 1 ? centroid[i].y : centroid[i].z);
+			int b = MIN(BVH_BINS - 1, (int)((c - cmin[k]) * scale));
+			binCount[b]++;
+			Vertex3D corner[3] = {tri[3*i], tri[3*i] + tri[3*i + 1], tri[3*i] + tri[3*i + 2]};
+			for(int q = 0; q < 3; q++){
+				float p[3] = {corner[q].x, corner[q].y, corner[q].z};
+				for(int j = 0; j < 3; j++){
+					binMin[b][j] = MIN(binMin[b][j], p[j]);
+					binMax[b][j] = MAX(binMax[b][j], p[j]);
+				}
+			}
+		}
+		//areas and counts left of every plane, then right of it on the way back
+		float leftArea[BVH_BINS - 1];
+		unsigned int leftCount[BVH_BINS - 1];
+		float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+		unsigned int n = 0;
+		for(int b = 0; b < BVH_BINS - 1; b++){
+			n += binCount[b];
+			for(int j = 0; j < 3; j++){ lo[j] = MIN(lo[j], binMin[b][j]); hi[j] = MAX(hi[j], binMax[b][j]); }
+			leftCount[b] = n;
+			leftArea[b] = halfArea(lo, hi);
+		}
+		for(int j = 0; j < 3; j++){ lo[j] = 1e30f; hi[j] = -1e30f; }
+		n = 0;
+		for(int b = BVH_BINS - 1; b > 0; b--){
+			n += binCount[b];
+			for(int j = 0; j < 3; j++){ lo[j] = MIN(lo[j], binMin[b][j]); hi[j] = MAX(hi[j], binMax[b][j]); }
+			if(leftCount[b - 1] == 0 || n == 0) continue;
+			float cost = leftCount[b - 1]*leftArea[b - 1] + n*halfArea(lo, hi);
+			if(cost < bestCost){
+				bestCost = cost;
+				bestAxis = k;
+				bestSplit = cmin[k] + b / scale;
+			}
+		}
+	}
+	if(bestAxis < 0) return;
+
+	//partition the triangles of the node around the plane
+	unsigned int i = node.leftFirst, j = node.leftFirst + node.count;
+	while(i < j){
+		float c = bestAxis == 0 ? centroid[i].x : (bestAxis == 1 ? centroid[i].y : centroid[i].z);
+		if(c < bestSplit) i++;
+		else{
+			j--;
+			std::swap(triIndex[i], triIndex[j]);
+			std::swap(centroid[i], centroid[j]);
+			for(int q = 0; q < 3; q++) std::swap(tri[3*i + q], tri[3*j + q]);
+		}
+	}
+	unsigned int leftCount = i - node.leftFirst;
+	if(leftCount == 0 || leftCount == node.count) return;
+
+	unsigned int left = nodeCount.fetch_add(2);
+	nodes[left].leftFirst = node.leftFirst; nodes[left].count = leftCount;
+	nodes[left + 1].leftFirst = i; nodes[left + 1].count = node.count - leftCount;
+	node.leftFirst = left;
+	node.count = 0;
+
+	ThreadPool& pool = ThreadPool::instance();
+	for(unsigned int c = left; c <= left + 1; c++){
+		if(nodes[c].count > BVH_PARALLEL_SPLIT)
+			pool.run(group, [this, c, &group]{ subdivide(c, group); });
+		else
+			subdivide(c, group);
+	}
+}
+
+//builds the tree over the surfaces (1-based vertex indices as in the OBJ file)
+void BVH::build(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex){
+	unsigned int n = surfaceVertex.size();
+	nodes.assign(n ? 2*n - 1 : 0, BVHNode());
+	nodeCount = 0;
+	depth = 0;
+	if(n == 0) return;
+	triIndex.resize(n);
+	for(unsigned int i = 0; i < n; i++)
+		triIndex[i] = i;
+	loadTriangles(position, surfaceVertex);
+	centroid.resize(n);
+	ThreadPool& pool = ThreadPool::instance();
+	pool.parallelFor(0, n, 4096, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++)
+			centroid[i] = tri[3*i] + (tri[3*i + 1] + tri[3*i + 2]) / 3;
+	});
+
+	nodeCount = 1;
+	nodes[0].leftFirst = 0;
+	nodes[0].count = n;
+	TaskGroup group;
+	pool.run(group, [this, &group]{ subdivide(0, group); });
+	pool.wait(group);
+	nodes.resize(nodeCount);
+	std::vector<Vertex3D>().swap(centroid);
+
+	//children are always allocated after their parent, so one forward sweep finds every level
+	std::vector<unsigned int> level(nodes.size(), 1);
+	depth = 1;
+	for(unsigned int i = 0; i < nodes.size(); i++)
+		if(nodes[i].count == 0){
+			level[nodes[i].leftFirst] = level[nodes[i].leftFirst + 1] = level[i] + 1;
+			depth = MAX(depth, level[i] + 1);
+		}
+}
+
+//updates the bounds after the vertices moved, keeping the tree structure
+void BVH::refit(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex){
+	if(nodes.empty()) return;
+	loadTriangles(position, surfaceVertex);
+	//children are always allocated after their parent, so a reverse sweep sees them first
+	for(int i = nodes.size() - 1; i >= 0; i--){
+		BVHNode& node = nodes[i];
+		if(node.count > 0){
+			fitNode(node);
+			continue;
+		}
+		const BVHNode& a = nodes[node.leftFirst];
+		const BVHNode& b = nodes[node.leftFirst + 1];
+		for(int k = 0; k < 3; k++){
+			node.bmin[k] = MIN(a.bmin[k], b.bmin[k]);
+			node.bmax[k] = MAX(a.bmax[k], b.bmax[k]);
+		}
+	}
+}
+
+//entry distance of the ray into a node's box, 1e30 if it misses or enters beyond tMax
+inline float slabTest(const BVHNode& node, const float* o, const float* inv, float tMax){
+	float t0 = 0, t1 = tMax;
+	for(int k = 0; k < 3; k++){
+		float a = (node.bmin[k] - o[k]) * inv[k];
+		float b = (node.bmax[k] - o[k]) * inv[k];
+		t0 = MAX(t0, MIN(a, b));
+		t1 = MIN(t1, MAX(a, b));
+	}
+	return t0 <= t1 ? t0 : 1e30f;
+}
+
+//nearest hit along the ray, nearer child first (Moller-Trumbore for the triangles)
+//the farther child waits on the stack with its entry distance and is dropped when a nearer hit is found first
+bool BVH::intersect(const Ray& ray, RayHit& hit) const{
+	hit = RayHit();
+	if(nodes.empty()) return false;
+	hit.t = ray.tMax;
+	const Vertex3D& d = ray.direction;
+	float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+	float inv[3] = {1/d.x, 1/d.y, 1/d.z};
+	BVHStackEntry local[BVH_STACK];
+	std::vector<BVHStackEntry> deep(depth > BVH_STACK ? depth : 0);
+	BVHStackEntry* stack = depth > BVH_STACK ? &deep[0] : local;
+	unsigned int top = 0, current = 0;
+	if(slabTest(nodes[0], o, inv, hit.t) == 1e30f) return false;
+	while(true){
+		const BVHNode& node = nodes[current];
+		if(node.count > 0){
+			for(unsigned int i = node.leftFirst; i < node.leftFirst + node.count; i++){
+				const Vertex3D& e1 = tri[3*i + 1];
+				const Vertex3D& e2 = tri[3*i + 2];
+				Vertex3D p = d.crossProduct(e2);
+				float det = e1.dotProduct(p);
+				if(det > -1e-12f && det < 1e-12f) continue;
+				float invDet = 1 / det;
+				Vertex3D s = ray.origin - tri[3*i];
+				float u = s.dotProduct(p) * invDet;
+				if(u < 0 || u > 1) continue;
+				Vertex3D q = s.crossProduct(e1);
+				float v = d.dotProduct(q) * invDet;
+				if(v < 0 || u + v > 1) continue;
+				float t = e2.dotProduct(q) * invDet;
+				if(t > 0 && t < hit.t){
+					hit.t = t; hit.u = u; hit.v = v;
+					hit.triangle = triIndex[i];
+				}
+			}
+		}
+		else{
+			unsigned int a = node.leftFirst, b = node.leftFirst + 1;
+			float ta = slabTest(nodes[a], o, inv, hit.t), tb = slabTest(nodes[b], o, inv, hit.t);
+			if(ta > tb){ std::swap(ta, tb); std::swap(a, b); }
+			if(ta != 1e30f){
+				if(tb != 1e30f){
+					stack[top].node = b;
+					stack[top++].t = tb;
+				}
+				current = a;
+				continue;
+			}
+		}
+		//pop the next box that is still nearer than the nearest hit
+		while(top > 0 && stack[top - 1].t >= hit.t)
+			top--;
+		if(top == 0) break;
+		current = stack[--top].node;
+	}
+	return hit.triangle >= 0;
+}
+
+//casts a batch of rays in parallel
+void BVH::intersect(const Ray* rays, RayHit* hits, unsigned int n) const{
+	ThreadPool::instance().parallelFor(0, n, 1024, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++)
+			intersect(rays[i], hits[i]);
+	});
+}
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef _FRAMEWRITER_H_
+#define _FRAMEWRITER_H_
+
+#include "VertexColorHeader.h"
+#include <atomic>
+#include <cctype>
+#include <csignal>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum FrameFormat{ FRAME_PPM, FRAME_PNG, FRAME_YUV };
+
+//guesses the output format from the target name, "|command" pipes raw YUV to the command
+FrameFormat frameFormatOf(const std::string& target){
+	if(!target.empty() && target[0] == '|') return FRAME_YUV;
+	size_t dot = target.find_last_of('.');
+	std::string ext = dot == std::string::npos ? "" : target.substr(dot + 1);
+	if(ext == "png") return FRAME_PNG;
+	if(ext == "yuv") return FRAME_YUV;
+	return FRAME_PPM;
+}
+
+//whether an image sequence name is a printf pattern with exactly one integer conversion for the
+//frame number, such as frame_%04d.png; other conversions than %% are refused, none of them has an argument
+bool isFramePattern(const std::string& pattern){
+	int conversions = 0;
+	for(size_t i = 0; i < pattern.size(); i++){
+		if(pattern[i] != '%') continue;
+		if(++i < pattern.size() && pattern[i] == '%') continue;
+		while(i < pattern.size() && strchr("-+ 0#", pattern[i])) i++; //flags
+		while(i < pattern.size() && isdigit((unsigned char)pattern[i])) i++; //width
+		if(i < pattern.size() && pattern[i] == '.')
+			for(i++; i < pattern.size() && isdigit((unsigned char)pattern[i]); i++); //precision
+		if(i == pattern.size() || !strchr("diuoxX", pattern[i])) return false;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+//crc of a png chunk
+unsigned int pngCrc(const unsigned char* data, size_t size, unsigned int crc = 0xffffffff){
+	static unsigned int table[256];
+	static bool filled = false;
+	if(!filled){
+		for(unsigned int n = 0; n < 256; n++){
+			unsigned int c = n;
+			for(int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		filled = true;
+	}
+	for(size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+void pushBigEndian(std::vector<unsigned char>& out, unsigned int v){
+	out.push_back(v >> 24); out.push_back(v >> 16); out.push_back(v >> 8); out.push_back(v);
+}
+
+void pushPngChunk(std::vector<unsigned char>& out, const char* type, const std::vector<unsigned char>& data){
+	pushBigEndian(out, data.size());
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	pushBigEndian(out, pngCrc(&out[start], out.size() - start) ^ 0xffffffff);
+}
+
+//encodes packed RGB as a png with stored (uncompressed) deflate blocks
+//no compression library is needed and the encoder stays far cheaper than the rasterizer
+void encodePNG(const unsigned char* rgb, int width, int height, std::vector<unsigned char>& out){
+	static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	out.assign(signature, signature + 8);
+
+	std::vector<unsigned char> header;
+	pushBigEndian(header, width); pushBigEndian(header, height);
+	header.push_back(8); header.push_back(2); //8 bit truecolor
+	header.push_back(0); header.push_back(0); header.push_back(0);
+	pushPngChunk(out, "IHDR", header);
+
+	//every row starts with filter type 0
+	std::vector<unsigned char> raw;
+	raw.reserve((size_t)(width*3 + 1)*height);
+	for(int y = 0; y < height; y++){
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb + (size_t)y*width*3, rgb + (size_t)(y + 1)*width*3);
+	}
+	std::vector<unsigned char> zlib;
+	zlib.reserve(raw.size() + raw.size()/65535*5 + 16);
+	zlib.push_back(0x78); zlib.push_back(0x01);
+	unsigned int a = 1, b = 0;
+	size_t pos = 0;
+	do{
+		size_t len = MIN(raw.size() - pos, (size_t)65535);
+		zlib.push_back(pos + len == raw.size() ? 1 : 0);
+		zlib.push_back(len & 0xff); zlib.push_back(len >> 8);
+		zlib.push_back(~len & 0xff); zlib.push_back((~len >> 8) & 0xff);
+		for(size_t i = pos; i < pos + len; i++){
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+		pos += len;
+	}while(pos < raw.size());
+	pushBigEndian(zlib, (b << 16) | a);
+	pushPngChunk(out, "IDAT", zlib);
+	pushPngChunk(out, "IEND", std::vector<unsigned char>());
+}
+
+//converts packed RGB to planar YUV 4:2:0 (BT.601), the layout encoders take as rawvideo yuv420p
+void encodeYUV(const unsigned char* rgb, int width, int height, std::vector<unsigned char>& out){
+	int cw = (width + 1) / 2, ch = (height + 1) / 2;
+	out.resize((size_t)width*height + 2*(size_t)cw*ch);
+	unsigned char* Y = &out[0];
+	unsigned char* U = Y + (size_t)width*height;
+	unsigned char* V = U + (size_t)cw*ch;
+	for(int y = 0; y < height; y++)
+		for(int x = 0; x < width; x++){
+			const unsigned char* p = rgb + ((size_t)y*width + x)*3;
+			Y[(size_t)y*width + x] = (66*p[0] + 129*p[1] + 25*p[2] + 128) / 256 + 16;
+		}
+	for(int y = 0; y < ch; y++)
+		for(int x = 0; x < cw; x++){
+			int r = 0, g = 0, b = 0, n = 0;
+			for(int dy = 0; dy < 2; dy++)
+				for(int dx = 0; dx < 2; dx++){
+					int sx = 2*x + dx, sy = 2*y + dy;
+					if(sx >= width || sy >= height) continue;
+					const unsigned char* p = rgb + ((size_t)sy*width + sx)*3;
+					r += p[0]; g += p[1]; b += p[2]; n++;
+				}
+			r /= n; g /= n; b /= n;
+			U[(size_t)y*cw + x] = (-38*r - 74*g + 112*b + 128) / 256 + 128;
+			V[(size_t)y*cw + x] = (112*r - 94*g - 18*b + 128) / 256 + 128;
+		}
+}
+
+//writes rendered frames from a bounded ring of RGB buffers on its own thread
+//the renderer only waits when every buffer of the ring is still queued for writing
+class FrameWriter
+{
+	FrameFormat format;
+	std::string target; //printf pattern for image sequences, file or "|command" for YUV
+	int width, height;
+	std::vector<std::vector<unsigned char> > ring;
+	unsigned int head, tail, filled; //next buffer to render into, next to write, buffers queued
+	unsigned int frameNumber; //frames handed to the writer
+	unsigned int stalls; //times the renderer had to wait for a free buffer
+	bool closing;
+	std::atomic<bool> failed; //a frame could not be written, the rest are dropped
+	FILE* stream; //YUV output
+	bool piped;
+#ifdef SIGPIPE
+	void (*pipeHandler)(int); //restored on close, a command that exits early must not kill the renderer
+#endif
+	std::mutex lock;
+	std::condition_variable frameReady, bufferFree;
+	std::thread writer;
+	void writerLoop();
+	bool write(const std::vector<unsigned char>&, unsigned int);
+public:
+	FrameWriter(const std::string&, FrameFormat, int, int, unsigned int = 4);
+	unsigned char* acquire();
+	void submit();
+	void close();
+	unsigned int frames() const {return frameNumber;}
+	unsigned int waits() const {return stalls;}
+	bool ok() const {return !failed;}
+	~FrameWriter(){ close(); }
+};
+
+FrameWriter::FrameWriter(const std::string& name, FrameFormat f, int w, int h, unsigned int ringSize):
+	format(f), target(name), width(w), height(h), ring(MAX(ringSize, 2u)), head(0), tail(0), filled(0),
+	frameNumber(0), stalls(0), closing(false), failed(false), stream(NULL), piped(false){
+	for(unsigned int i = 0; i < ring.size(); i++)
+		ring[i].resize((size_t)width*height*3);
+	if(format != FRAME_YUV && !isFramePattern(target)){
+		std::cout<<"Can't use "<<target<<" as the frame names, it needs exactly one integer conversion like %04d.\n";
+		throw "Can't open";
+	}
+	if(format == FRAME_YUV){
+		piped = !target.empty() && target[0] == '|';
+#ifdef SIGPIPE
+		if(piped) pipeHandler = signal(SIGPIPE, SIG_IGN);
+#endif
+		stream = piped ? popen(target.substr(1).c_str(), "w") : fopen(target.c_str(), "wb");
+		if(stream == NULL){
+			std::cout<<"Can't open the output "<<target<<".\n";
+			throw "Can't open";
+		}
+	}
+	writer = std::thread(&FrameWriter::writerLoop, this);
+}
+
+//buffer for the next frame, waits only while the ring is full
+//returns NULL once a frame could not be written so the renderer can stop
+unsigned char* FrameWriter::acquire(){
+	std::unique_lock<std::mutex> guard(lock);
+	if(filled == ring.size() && !failed){
+		stalls++;
+		bufferFree.wait(guard, [this]{ return filled < ring.size() || failed; });
+	}
+	return failed ? NULL : &ring[head][0];
+}
+
+//queues the acquired buffer for writing
+void FrameWriter::submit(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		head = (head + 1) % ring.size();
+		filled++;
+		frameNumber++;
+	}
+	frameReady.notify_one();
+}
+
+//writes the queued frames and stops the writer
+void FrameWriter::close(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(closing) return;
+		closing = true;
+	}
+	frameReady.notify_one();
+	writer.join();
+	if(stream)
+		piped ? pclose(stream) : fclose(stream);
+	stream = NULL;
+#ifdef SIGPIPE
+	if(piped) signal(SIGPIPE, pipeHandler);
+#endif
+}
+
+void FrameWriter::writerLoop(){
+	std::vector<unsigned char> encoded;
+	unsigned int index = 0;
+	while(true){
+		std::unique_lock<std::mutex> guard(lock);
+		frameReady.wait(guard, [this]{ return filled > 0 || closing; });
+		if(filled == 0) return;
+		std::vector<unsigned char>& rgb = ring[tail];
+		guard.unlock();
+
+		//encoding and disk writes happen without the lock, the renderer keeps filling other buffers
+		if(format == FRAME_PNG)
+			encodePNG(&rgb[0], width, height, encoded);
+		else if(format == FRAME_YUV)
+			encodeYUV(&rgb[0], width, height, encoded);
+		else{
+			char header[32];
+			int n = sprintf(header, "P6\n%d %d\n255\n", width, height);
+			encoded.assign(header, header + n);
+			encoded.insert(encoded.end(), rgb.begin(), rgb.end());
+		}
+		if(!failed && !write(encoded, index))
+			failed = true;
+		index++;
+
+		guard.lock();
+		tail = (tail + 1) % ring.size();
+		filled--;
+		guard.unlock();
+		bufferFree.notify_one();
+	}
+}
+
+bool FrameWriter::write(const std::vector<unsigned char>& data, unsigned int index){
+	if(stream){
+		if(fwrite(&data[0], 1, data.size(), stream) == data.size()) return true;
+		std::cout<<"Can't write to the output "<<target<<".\n";
+		return false;
+	}
+	char name[1024];
+	snprintf(name, sizeof(name), target.c_str(), index);
+	FILE* file = fopen(name, "wb");
+	if(file == NULL){
+		std::cout<<"Can't write the frame "<<name<<".\n";
+		return false;
+	}
+	bool written = fwrite(&data[0], 1, data.size(), file) == data.size();
+	fclose(file);
+	return written;
+}
+
+#endif
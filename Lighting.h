@@ -0,0 +1,252 @@
+#ifndef _LIGHTING_H_
+#define _LIGHTING_H_
+
+#include "VertexColorHeader.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//surface material, as described by a newmtl block of a .mtl file
+class Material
+{
+public:
+	std::string name;
+	Color ka, kd, ks, ke; //ambient, diffuse, specular and emissive reflectance
+	float shininess; //Blinn-Phong specular exponent (Ns)
+	std::string diffuseMap; //BMP image multiplied into the lit color (map_Kd), empty for none
+	Material():name("default"), ka(0.5, 0.5, 0.5), kd(0.5, 0.5, 0.5), ks(0.1, 0.1, 0.1), ke(0, 0, 0), shininess(32){}
+	Material(const std::string& n, Color a, Color d, Color s, Color e = Color(0, 0, 0), float ns = 32):
+		name(n), ka(a), kd(d), ks(s), ke(e), shininess(ns){}
+	~Material(){}
+};
+
+//reads every material of a .mtl file and appends it to the list
+//a missing library is not fatal, faces using its materials fall back to the default one
+bool loadMaterialLibrary(const std::string& filename, std::vector<Material>& materials){
+	std::ifstream mtlFile(filename.c_str());
+	if(!mtlFile.is_open()){
+		std::cout<<"Can't open the material library "<<filename<<".\n";
+		return false;
+	}
+	std::string line, keyword, directory;
+	size_t slash = filename.find_last_of("/\\");
+	if(slash != std::string::npos)
+		directory = filename.substr(0, slash + 1); //images are relative to the library
+	Material* current = NULL;
+	while(getline(mtlFile, line)){
+		std::istringstream linestream(line);
+		if(!(linestream >> keyword)) continue;
+		if(keyword == "newmtl"){
+			materials.push_back(Material());
+			current = &materials.back();
+			linestream >> current->name;
+		}
+		else if(current == NULL) continue;
+		else if(keyword == "Ka"){	linestream >> current->ka.r >> current->ka.g >> current->ka.b;	}
+		else if(keyword == "Kd"){	linestream >> current->kd.r >> current->kd.g >> current->kd.b;	}
+		else if(keyword == "Ks"){	linestream >> current->ks.r >> current->ks.g >> current->ks.b;	}
+		else if(keyword == "Ke"){	linestream >> current->ke.r >> current->ke.g >> current->ke.b;	}
+		else if(keyword == "Ns"){	linestream >> current->shininess;	}
+		else if(keyword == "map_Kd"){	linestream >> current->diffuseMap; current->diffuseMap = directory + current->diffuseMap;	}
+	}
+	return true;
+}
+
+//per-vertex material coefficients, one stream each
+enum MaterialCoefficient{
+	KA_R, KA_G, KA_B, KD_R, KD_G, KD_B, KS_R, KS_G, KS_B, KE_R, KE_G, KE_B, NS,
+	MATERIAL_COEFFICIENTS
+};
+
+//parts of the lighting computed by LightingEngine::shade
+//the diffuse terms (ambient, emissive and diffuse) do not depend on the eye, so views of one
+//scene can share them and add only their own specular term
+enum LightingTerms{ DIFFUSE_TERMS = 1, SPECULAR_TERMS = 2, ALL_TERMS = DIFFUSE_TERMS | SPECULAR_TERMS };
+
+//Blinn-Phong vertex lighting for any number of point and directional lights
+//vertices are kept as a struct of arrays padded to a multiple of 4 so that
+//the light loop runs on 4 vertices at once with SSE
+class LightingEngine
+{
+	unsigned int count; //number of real vertices
+	std::vector<float> px, py, pz; //vertex positions
+	std::vector<float> nx, ny, nz; //vertex normals
+	std::vector<float> coef[MATERIAL_COEFFICIENTS]; //per-vertex material
+	void shadeScalar(const std::vector<LightSource>&, const Vertex3D&, const Color&, Color*, unsigned int, int) const;
+#ifdef __SSE__
+	void shadeBlock(const std::vector<LightSource>&, const Vertex3D&, const Color&, Color*, unsigned int, int) const;
+#endif
+public:
+	LightingEngine():count(0){}
+	unsigned int size() const {return count;}
+	void setGeometry(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&);
+	void setMaterials(const std::vector<Material>&, const std::vector<int>&);
+	void shade(const std::vector<LightSource>&, const Vertex3D&, const Color&, Color*, unsigned int = 0, unsigned int = ~0u, int = ALL_TERMS) const;
+	~LightingEngine(){}
+};
+
+//copies positions and normals into the padded streams
+void LightingEngine::setGeometry(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& normal){
+	count = position.size();
+	unsigned int padded = (count + 3) & ~3u;
+	px.assign(padded, 0); py.assign(padded, 0); pz.assign(padded, 0);
+	nx.assign(padded, 0); ny.assign(padded, 0); nz.assign(padded, 0);
+	for(unsigned int i = 0; i < count; i++){
+		px[i] = position[i].x; py[i] = position[i].y; pz[i] = position[i].z;
+		nx[i] = normal[i].x; ny[i] = normal[i].y; nz[i] = normal[i].z;
+	}
+}
+
+//spreads the material of every vertex into the coefficient streams
+void LightingEngine::setMaterials(const std::vector<Material>& materials, const std::vector<int>& vertexMaterial){
+	unsigned int padded = (count + 3) & ~3u;
+	for(int k = 0; k < MATERIAL_COEFFICIENTS; k++)
+		coef[k].assign(padded, 0);
+	Material fallback;
+	for(unsigned int i = 0; i < count; i++){
+		int m = i < vertexMaterial.size() ? vertexMaterial[i] : -1;
+		const Material& mat = (m >= 0 && m < (int)materials.size()) ? materials[m] : fallback;
+		coef[KA_R][i] = mat.ka.r; coef[KA_G][i] = mat.ka.g; coef[KA_B][i] = mat.ka.b;
+		coef[KD_R][i] = mat.kd.r; coef[KD_G][i] = mat.kd.g; coef[KD_B][i] = mat.kd.b;
+		coef[KS_R][i] = mat.ks.r; coef[KS_G][i] = mat.ks.g; coef[KS_B][i] = mat.ks.b;
+		coef[KE_R][i] = mat.ke.r; coef[KE_G][i] = mat.ke.g; coef[KE_B][i] = mat.ke.b;
+		coef[NS][i] = mat.shininess;
+	}
+}
+
+//direction towards the light from a point, not normalized
+//a directional light stores the direction it shines from in pos
+inline Vertex3D lightVector(const LightSource& light, float x, float y, float z){
+	if(light.type == DIRECTIONAL_LIGHT)
+		return light.pos;
+	return Vertex3D(light.pos.x - x, light.pos.y - y, light.pos.z - z);
+}
+
+//Schlick's rational approximation of pow(t, n), cheap enough to vectorize
+inline float specularPower(float t, float n){
+	return t / (n - n*t + t);
+}
+
+//lights vertex i on its own
+void LightingEngine::shadeScalar(const std::vector<LightSource>& lights, const Vertex3D& eye, const Color& ambient, Color* out, unsigned int i, int terms) const{
+	bool diffuse = terms & DIFFUSE_TERMS, specular = terms & SPECULAR_TERMS;
+	Vertex3D n(nx[i], ny[i], nz[i]);
+	n.normalize();
+	Vertex3D v = specular ? (eye - Vertex3D(px[i], py[i], pz[i])).normalized() : Vertex3D(0, 0, 0);
+	float r = diffuse ? ambient.r*coef[KA_R][i] + coef[KE_R][i] : out[i].r;
+	float g = diffuse ? ambient.g*coef[KA_G][i] + coef[KE_G][i] : out[i].g;
+	float b = diffuse ? ambient.b*coef[KA_B][i] + coef[KE_B][i] : out[i].b;
+	for(unsigned int k = 0; k < lights.size(); k++){
+		Vertex3D l = lightVector(lights[k], px[i], py[i], pz[i]).normalized();
+		float costheta = n.dotProduct(l);
+		if(costheta <= 0) continue;
+		float tr = 0, tg = 0, tb = 0;
+		if(diffuse){
+			tr = coef[KD_R][i]*costheta; tg = coef[KD_G][i]*costheta; tb = coef[KD_B][i]*costheta;
+		}
+		if(specular){
+			float cosalpha = MAX(0, n.dotProduct((l + v).normalized()));
+			float spec = specularPower(cosalpha, coef[NS][i]);
+			tr += coef[KS_R][i]*spec; tg += coef[KS_G][i]*spec; tb += coef[KS_B][i]*spec;
+		}
+		r += lights[k].Intensity.r*tr;
+		g += lights[k].Intensity.g*tg;
+		b += lights[k].Intensity.b*tb;
+	}
+	out[i] = Color(r, g, b);
+}
+
+#ifdef __SSE__
+//lights vertices i..i+3 together
+void LightingEngine::shadeBlock(const std::vector<LightSource>& lights, const Vertex3D& eye, const Color& ambient, Color* out, unsigned int i, int terms) const{
+	bool diffuse = terms & DIFFUSE_TERMS, specular = terms & SPECULAR_TERMS;
+	const __m128 zero = _mm_setzero_ps();
+	__m128 x = _mm_loadu_ps(&px[i]), y = _mm_loadu_ps(&py[i]), z = _mm_loadu_ps(&pz[i]);
+	__m128 n0 = _mm_loadu_ps(&nx[i]), n1 = _mm_loadu_ps(&ny[i]), n2 = _mm_loadu_ps(&nz[i]);
+	__m128 len = rsqrt4(_mm_add_ps(_mm_add_ps(_mm_mul_ps(n0, n0), _mm_mul_ps(n1, n1)), _mm_mul_ps(n2, n2)));
+	n0 = _mm_mul_ps(n0, len); n1 = _mm_mul_ps(n1, len); n2 = _mm_mul_ps(n2, len);
+
+	__m128 v0 = _mm_sub_ps(_mm_set1_ps(eye.x), x), v1 = _mm_sub_ps(_mm_set1_ps(eye.y), y), v2 = _mm_sub_ps(_mm_set1_ps(eye.z), z);
+	len = rsqrt4(_mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, v0), _mm_mul_ps(v1, v1)), _mm_mul_ps(v2, v2)));
+	v0 = _mm_mul_ps(v0, len); v1 = _mm_mul_ps(v1, len); v2 = _mm_mul_ps(v2, len);
+
+	__m128 kdR = _mm_loadu_ps(&coef[KD_R][i]), kdG = _mm_loadu_ps(&coef[KD_G][i]), kdB = _mm_loadu_ps(&coef[KD_B][i]);
+	__m128 ksR = _mm_loadu_ps(&coef[KS_R][i]), ksG = _mm_loadu_ps(&coef[KS_G][i]), ksB = _mm_loadu_ps(&coef[KS_B][i]);
+	__m128 ns = _mm_loadu_ps(&coef[NS][i]);
+
+	__m128 r, g, b;
+	if(diffuse){
+		r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ambient.r), _mm_loadu_ps(&coef[KA_R][i])), _mm_loadu_ps(&coef[KE_R][i]));
+		g = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ambient.g), _mm_loadu_ps(&coef[KA_G][i])), _mm_loadu_ps(&coef[KE_G][i]));
+		b = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ambient.b), _mm_loadu_ps(&coef[KA_B][i])), _mm_loadu_ps(&coef[KE_B][i]));
+	}
+	else{
+		//the specular light goes on top of what out already holds
+		float rr[4] = {0, 0, 0, 0}, gg[4] = {0, 0, 0, 0}, bb[4] = {0, 0, 0, 0};
+		for(unsigned int j = 0; j < 4 && i + j < count; j++){
+			rr[j] = out[i + j].r; gg[j] = out[i + j].g; bb[j] = out[i + j].b;
+		}
+		r = _mm_loadu_ps(rr); g = _mm_loadu_ps(gg); b = _mm_loadu_ps(bb);
+	}
+
+	for(unsigned int k = 0; k < lights.size(); k++){
+		const LightSource& light = lights[k];
+		__m128 l0, l1, l2;
+		if(light.type == DIRECTIONAL_LIGHT){
+			Vertex3D d = light.pos.normalized();
+			l0 = _mm_set1_ps(d.x); l1 = _mm_set1_ps(d.y); l2 = _mm_set1_ps(d.z);
+		}
+		else{
+			l0 = _mm_sub_ps(_mm_set1_ps(light.pos.x), x);
+			l1 = _mm_sub_ps(_mm_set1_ps(light.pos.y), y);
+			l2 = _mm_sub_ps(_mm_set1_ps(light.pos.z), z);
+			len = rsqrt4(_mm_add_ps(_mm_add_ps(_mm_mul_ps(l0, l0), _mm_mul_ps(l1, l1)), _mm_mul_ps(l2, l2)));
+			l0 = _mm_mul_ps(l0, len); l1 = _mm_mul_ps(l1, len); l2 = _mm_mul_ps(l2, len);
+		}
+		__m128 costheta = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n0, l0), _mm_mul_ps(n1, l1)), _mm_mul_ps(n2, l2));
+		__m128 lit = _mm_cmpgt_ps(costheta, zero);
+		if(_mm_movemask_ps(lit) == 0) continue;
+
+		__m128 tr = zero, tg = zero, tb = zero;
+		if(diffuse){
+			costheta = _mm_and_ps(costheta, lit);
+			tr = _mm_mul_ps(kdR, costheta); tg = _mm_mul_ps(kdG, costheta); tb = _mm_mul_ps(kdB, costheta);
+		}
+		if(specular){
+			//half vector between light and view directions
+			__m128 h0 = _mm_add_ps(l0, v0), h1 = _mm_add_ps(l1, v1), h2 = _mm_add_ps(l2, v2);
+			len = rsqrt4(_mm_add_ps(_mm_add_ps(_mm_mul_ps(h0, h0), _mm_mul_ps(h1, h1)), _mm_mul_ps(h2, h2)));
+			__m128 cosalpha = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(n0, h0), _mm_mul_ps(n1, h1)), _mm_mul_ps(n2, h2)), len);
+			cosalpha = _mm_max_ps(cosalpha, zero);
+			__m128 spec = _mm_div_ps(cosalpha, _mm_add_ps(_mm_sub_ps(ns, _mm_mul_ps(ns, cosalpha)), cosalpha));
+			spec = _mm_and_ps(spec, lit);
+			tr = _mm_add_ps(tr, _mm_mul_ps(ksR, spec)); tg = _mm_add_ps(tg, _mm_mul_ps(ksG, spec)); tb = _mm_add_ps(tb, _mm_mul_ps(ksB, spec));
+		}
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(light.Intensity.r), tr));
+		g = _mm_add_ps(g, _mm_mul_ps(_mm_set1_ps(light.Intensity.g), tg));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_set1_ps(light.Intensity.b), tb));
+	}
+
+	float rr[4], gg[4], bb[4];
+	_mm_storeu_ps(rr, r); _mm_storeu_ps(gg, g); _mm_storeu_ps(bb, b);
+	for(unsigned int j = 0; j < 4 && i + j < count; j++)
+		out[i + j] = Color(rr[j], gg[j], bb[j]);
+}
+#endif
+
+//lights vertices [begin, end) as seen from eye, begin must be a multiple of 4
+//terms without the diffuse ones add the specular light to the colors already in out
+void LightingEngine::shade(const std::vector<LightSource>& lights, const Vertex3D& eye, const Color& ambient, Color* out, unsigned int begin, unsigned int end, int terms) const{
+	end = MIN(end, count);
+#ifdef __SSE__
+	for(unsigned int i = begin; i < end; i += 4)
+		shadeBlock(lights, eye, ambient, out, i, terms);
+#else
+	for(unsigned int i = begin; i < end; i++)
+		shadeScalar(lights, eye, ambient, out, i, terms);
+#endif
+}
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef _MESHOPTIMIZER_H_
+#define _MESHOPTIMIZER_H_
+
+#include "VertexColorHeader.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#define VERTEX_CACHE_SIZE 32 //LRU cache modelled by the triangle ordering
+#define ACMR_CACHE_SIZE 16 //FIFO cache used to report the average cache miss ratio
+
+//how well a triangle order reuses vertices
+class MeshStats
+{
+public:
+	float acmr; //vertex cache misses per triangle, between 0.5 (ideal) and 3
+	float lineMisses; //64 byte lines of the vertex arrays fetched per triangle, with a 64 line LRU
+	MeshStats():acmr(0), lineMisses(0){}
+	~MeshStats(){}
+};
+
+//simulates the post-transform FIFO cache and a small data cache over the vertex fetches
+//surfaces hold 1-based vertex indices as in the OBJ file
+MeshStats meshStats(const std::vector<Vertex3D>& surfaceVertex){
+	MeshStats stats;
+	if(surfaceVertex.empty()) return stats;
+	std::vector<int> fifo(ACMR_CACHE_SIZE, -1), lines(64, -1);
+	unsigned int head = 0, misses = 0, lineMiss = 0;
+	for(unsigned int f = 0; f < surfaceVertex.size(); f++){
+		int corner[3] = {(int)surfaceVertex[f].x - 1, (int)surfaceVertex[f].y - 1, (int)surfaceVertex[f].z - 1};
+		for(int k = 0; k < 3; k++){
+			if(std::find(fifo.begin(), fifo.end(), corner[k]) == fifo.end()){
+				fifo[head] = corner[k];
+				head = (head + 1) % fifo.size();
+				misses++;
+			}
+			int line = corner[k]*(int)sizeof(Vertex3D) / 64;
+			std::vector<int>::iterator hit = std::find(lines.begin(), lines.end(), line);
+			if(hit == lines.end()){
+				lineMiss++;
+				hit = lines.end() - 1;
+			}
+			lines.erase(hit);
+			lines.insert(lines.begin(), line);
+		}
+	}
+	stats.acmr = (float)misses / surfaceVertex.size();
+	stats.lineMisses = (float)lineMiss / surfaceVertex.size();
+	return stats;
+}
+
+//score of a vertex in Forsyth's linear-speed vertex cache optimisation
+float forsythScore(int cachePosition, int remaining){
+	if(remaining == 0) return -1;
+	float score = 0;
+	if(cachePosition >= 0){
+		if(cachePosition < 3)
+			score = 0.75f; //the last triangle's vertices, no bonus for using them right away
+		else
+			score = pow(1.0f - (float)(cachePosition - 3) / (VERTEX_CACHE_SIZE - 3), 1.5f);
+	}
+	return score + 2.0f / sqrt((float)remaining); //finish off vertices with few triangles left
+}
+
+//triangle order that reuses recently transformed vertices (Forsyth)
+std::vector<unsigned int> vertexCacheOrder(const std::vector<Vertex3D>& surfaceVertex, unsigned int vertexCount){
+	unsigned int nTriangle = surfaceVertex.size();
+	std::vector<unsigned int> corner(3*nTriangle);
+	for(unsigned int f = 0; f < nTriangle; f++){
+		corner[3*f] = (unsigned int)surfaceVertex[f].x - 1;
+		corner[3*f + 1] = (unsigned int)surfaceVertex[f].y - 1;
+		corner[3*f + 2] = (unsigned int)surfaceVertex[f].z - 1;
+	}
+	//triangles around every vertex
+	std::vector<unsigned int> start(vertexCount + 1, 0), list(3*nTriangle);
+	for(unsigned int i = 0; i < 3*nTriangle; i++) start[corner[i] + 1]++;
+	for(unsigned int v = 0; v < vertexCount; v++) start[v + 1] += start[v];
+	std::vector<unsigned int> fill(start.begin(), start.end() - 1);
+	for(unsigned int i = 0; i < 3*nTriangle; i++) list[fill[corner[i]]++] = i / 3;
+
+	std::vector<int> remaining(vertexCount), position(vertexCount, -1);
+	std::vector<float> vertexScore(vertexCount), triangleScore(nTriangle, 0);
+	std::vector<bool> added(nTriangle, false);
+	for(unsigned int v = 0; v < vertexCount; v++){
+		remaining[v] = start[v + 1] - start[v];
+		vertexScore[v] = forsythScore(-1, remaining[v]);
+	}
+	for(unsigned int i = 0; i < 3*nTriangle; i++)
+		triangleScore[i / 3] += vertexScore[corner[i]];
+
+	std::vector<unsigned int> order;
+	order.reserve(nTriangle);
+	std::vector<int> cache, next;
+	unsigned int cursor = 0; //first triangle that may not be added yet
+	int best = -1;
+	while(order.size() < nTriangle){
+		if(best < 0){ //nothing in the cache to continue with, start again at the next unused triangle
+			while(added[cursor]) cursor++;
+			best = cursor;
+		}
+		added[best] = true;
+		order.push_back(best);
+
+		//the triangle's vertices move to the front of the cache
+		next.assign(corner.begin() + 3*best, corner.begin() + 3*best + 3);
+		for(int k = 0; k < 3; k++) remaining[next[k]]--;
+		for(unsigned int i = 0; i < cache.size(); i++)
+			if(std::find(next.begin(), next.begin() + 3, cache[i]) == next.begin() + 3)
+				next.push_back(cache[i]);
+		for(unsigned int i = VERTEX_CACHE_SIZE; i < next.size(); i++)
+			position[next[i]] = -1; //evicted
+		for(unsigned int i = 0; i < next.size(); i++){
+			int v = next[i];
+			if(i < VERTEX_CACHE_SIZE) position[v] = i;
+			float score = forsythScore(position[v], remaining[v]);
+			float delta = score - vertexScore[v];
+			vertexScore[v] = score;
+			for(unsigned int k = start[v]; k < start[v + 1]; k++)
+				triangleScore[list[k]] += delta;
+		}
+		if(next.size() > VERTEX_CACHE_SIZE) next.resize(VERTEX_CACHE_SIZE);
+		cache.swap(next);
+
+		//best triangle using a cached vertex
+		best = -1;
+		for(unsigned int i = 0; i < cache.size(); i++)
+			for(unsigned int k = start[cache[i]]; k < start[cache[i] + 1]; k++){
+				unsigned int f = list[k];
+				if(!added[f] && (best < 0 || triangleScore[f] > triangleScore[best])) best = f;
+			}
+	}
+	return order;
+}
+
+//interleaves the bits of a 10 bit coordinate with two zero bits
+unsigned int spreadBits(unsigned int v){
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+//triangles sorted along a Morton curve of their centroids
+//the cache ordering restarts at the next unused triangle of its input, so running it on this
+//order makes every new cluster of triangles start next to the previous one
+std::vector<unsigned int> spatialOrder(const std::vector<Vertex3D>& surfaceVertex, const std::vector<Vertex3D>& position){
+	std::vector<unsigned int> order;
+	if(position.empty()) return order;
+	Vertex3D lo = position[0], hi = position[0];
+	for(unsigned int i = 1; i < position.size(); i++){
+		lo = Vertex3D(MIN(lo.x, position[i].x), MIN(lo.y, position[i].y), MIN(lo.z, position[i].z));
+		hi = Vertex3D(MAX(hi.x, position[i].x), MAX(hi.y, position[i].y), MAX(hi.z, position[i].z));
+	}
+	Vertex3D extent = hi - lo;
+	std::vector<std::pair<unsigned int, unsigned int> > key; //Morton code, triangle
+	for(unsigned int f = 0; f < surfaceVertex.size(); f++){
+		const Vertex3D& s = surfaceVertex[f];
+		Vertex3D centroid = (position[(int)s.x - 1] + position[(int)s.y - 1] + position[(int)s.z - 1]) / 3 - lo;
+		unsigned int x = extent.x > 0 ? (unsigned int)(1023*centroid.x/extent.x) : 0;
+		unsigned int y = extent.y > 0 ? (unsigned int)(1023*centroid.y/extent.y) : 0;
+		unsigned int z = extent.z > 0 ? (unsigned int)(1023*centroid.z/extent.z) : 0;
+		key.push_back(std::make_pair(spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2), f));
+	}
+	std::stable_sort(key.begin(), key.end());
+	for(unsigned int k = 0; k < key.size(); k++)
+		order.push_back(key[k].second);
+	return order;
+}
+
+//new index of every vertex, numbered in the order the triangles first use them
+//vertices used by no triangle keep their relative order at the end
+std::vector<unsigned int> firstUseOrder(const std::vector<Vertex3D>& surfaceVertex, unsigned int vertexCount){
+	std::vector<unsigned int> remap(vertexCount, ~0u);
+	unsigned int next = 0;
+	for(unsigned int f = 0; f < surfaceVertex.size(); f++){
+		const Vertex3D& s = surfaceVertex[f];
+		unsigned int corner[3] = {(unsigned int)s.x - 1, (unsigned int)s.y - 1, (unsigned int)s.z - 1};
+		for(int k = 0; k < 3; k++)
+			if(remap[corner[k]] == ~0u) remap[corner[k]] = next++;
+	}
+	for(unsigned int v = 0; v < vertexCount; v++)
+		if(remap[v] == ~0u) remap[v] = next++;
+	return remap;
+}
+
+//puts the elements of a per-vertex array at their new indices
+template<typename T>
+void applyRemap(std::vector<T>& data, const std::vector<unsigned int>& remap){
+	if(data.size() != remap.size()) return;
+	std::vector<T> moved(data.size());
+	for(unsigned int i = 0; i < data.size(); i++)
+		moved[remap[i]] = data[i];
+	data.swap(moved);
+}
+
+//puts the elements of a per-triangle array in the new triangle order
+template<typename T>
+void applyOrder(std::vector<T>& data, const std::vector<unsigned int>& order){
+	if(data.size() != order.size()) return;
+	std::vector<T> moved(data.size());
+	for(unsigned int i = 0; i < order.size(); i++)
+		moved[i] = data[order[i]];
+	data.swap(moved);
+}
+
+#endif
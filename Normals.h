@@ -0,0 +1,133 @@
+#ifndef _NORMALS_H_
+#define _NORMALS_H_
+
+#include "ThreadPool.h"
+#include "VertexColorHeader.h"
+#include <vector>
+
+#define NORMAL_CHUNK 1024 //vertices per parallel job
+
+//how the faces around a vertex contribute to its smooth normal
+enum NormalWeighting{
+	AREA_WEIGHTED, //by face area, large faces dominate
+	ANGLE_WEIGHTED //by the corner angle at the vertex, independent of tessellation
+};
+
+//normalizes vectors [begin, end) in place, 4 at a time with SSE
+void normalizeAll(std::vector<Vertex3D>& v, unsigned int begin = 0, unsigned int end = ~0u){
+	end = MIN(end, (unsigned int)v.size());
+	unsigned int i = begin;
+#ifdef __SSE__
+	//4 packed vertices are x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+	for(; i + 4 <= end; i += 4){
+		float* p = &v[i].x;
+		__m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+		__m128 x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+		__m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), c, _MM_SHUFFLE(3, 0, 2, 0));
+		__m128 f = rsqrt4(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		_mm_storeu_ps(p, _mm_mul_ps(a, _mm_shuffle_ps(f, f, _MM_SHUFFLE(1, 0, 0, 0))));
+		_mm_storeu_ps(p + 4, _mm_mul_ps(b, _mm_shuffle_ps(f, f, _MM_SHUFFLE(2, 2, 1, 1))));
+		_mm_storeu_ps(p + 8, _mm_mul_ps(c, _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 2))));
+	}
+#endif
+	for(; i < end; i++)
+		v[i].normalize();
+}
+
+//smooth vertex normals computed from the geometry of an indexed triangle mesh
+//keeps the faces around every vertex so that each normal is gathered independently:
+//all of them in one parallel pass, or only those around vertices that moved
+class NormalBuilder
+{
+	std::vector<unsigned int> faceStart; //faces around vertex i are faceList[faceStart[i] .. faceStart[i+1])
+	std::vector<unsigned int> faceList;
+	NormalWeighting weighting;
+	Vertex3D gather(unsigned int, const std::vector<Vertex3D>&, const std::vector<Vertex3D>&) const;
+public:
+	NormalBuilder(NormalWeighting w = ANGLE_WEIGHTED):weighting(w){}
+	void build(const std::vector<Vertex3D>&, unsigned int);
+	void compute(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&, std::vector<Vertex3D>&) const;
+	void update(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&, const std::vector<unsigned int>&, std::vector<Vertex3D>&) const;
+	bool empty() const {return faceStart.empty();}
+	~NormalBuilder(){}
+};
+
+//indexes the faces around every vertex, surfaces hold 1-based vertex indices as in the OBJ file
+void NormalBuilder::build(const std::vector<Vertex3D>& surfaceVertex, unsigned int vertexCount){
+	faceStart.assign(vertexCount + 1, 0);
+	for(unsigned int f = 0; f < surfaceVertex.size(); f++){
+		faceStart[(unsigned int)surfaceVertex[f].x]++;
+		faceStart[(unsigned int)surfaceVertex[f].y]++;
+		faceStart[(unsigned int)surfaceVertex[f].z]++;
+	}
+	for(unsigned int i = 0; i < vertexCount; i++)
+		faceStart[i + 1] += faceStart[i];
+	faceList.resize(faceStart[vertexCount]);
+	std::vector<unsigned int> fill(faceStart.begin(), faceStart.end() - 1);
+	for(unsigned int f = 0; f < surfaceVertex.size(); f++){
+		faceList[fill[(unsigned int)surfaceVertex[f].x - 1]++] = f;
+		faceList[fill[(unsigned int)surfaceVertex[f].y - 1]++] = f;
+		faceList[fill[(unsigned int)surfaceVertex[f].z - 1]++] = f;
+	}
+}
+
+//weighted sum of the normals of the faces around vertex v, not normalized
+Vertex3D NormalBuilder::gather(unsigned int v, const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex) const{
+	Vertex3D sum;
+	for(unsigned int k = faceStart[v]; k < faceStart[v + 1]; k++){
+		const Vertex3D& s = surfaceVertex[faceList[k]];
+		unsigned int a = (unsigned int)s.x - 1, b = (unsigned int)s.y - 1, c = (unsigned int)s.z - 1;
+		//twice the face area in length, counter-clockwise faces point outwards
+		Vertex3D n = (position[b] - position[a]).crossProduct(position[c] - position[a]);
+		if(weighting == AREA_WEIGHTED){
+			sum = sum + n;
+			continue;
+		}
+		//corner of the face at v
+		unsigned int p = v == a ? b : (v == b ? c : a);
+		unsigned int q = v == a ? c : (v == b ? a : b);
+		float cosine = (position[p] - position[v]).cosine(position[q] - position[v]);
+		if(cosine != cosine) continue; //degenerate corner
+		sum = sum + n.normalized()*acos(MAX(-1.0f, MIN(1.0f, cosine)));
+	}
+	return sum;
+}
+
+//recomputes every vertex normal
+void NormalBuilder::compute(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex, std::vector<Vertex3D>& normal) const{
+	normal.resize(position.size());
+	ThreadPool::instance().parallelFor(0, position.size(), NORMAL_CHUNK, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++)
+			normal[i] = gather(i, position, surfaceVertex);
+		normalizeAll(normal, begin, end);
+	});
+}
+
+//recomputes the normals affected by moving the given vertices:
+//theirs and those of every vertex sharing a face with them
+void NormalBuilder::update(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex,
+	const std::vector<unsigned int>& moved, std::vector<Vertex3D>& normal) const{
+	std::vector<bool> marked(position.size(), false);
+	std::vector<unsigned int> affected;
+	for(unsigned int i = 0; i < moved.size(); i++){
+		unsigned int v = moved[i];
+		for(unsigned int k = faceStart[v]; k < faceStart[v + 1]; k++){
+			const Vertex3D& s = surfaceVertex[faceList[k]];
+			unsigned int corner[3] = {(unsigned int)s.x - 1, (unsigned int)s.y - 1, (unsigned int)s.z - 1};
+			for(int j = 0; j < 3; j++)
+				if(!marked[corner[j]]){
+					marked[corner[j]] = true;
+					affected.push_back(corner[j]);
+				}
+		}
+	}
+	ThreadPool::instance().parallelFor(0, affected.size(), NORMAL_CHUNK, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++){
+			normal[affected[i]] = gather(affected[i], position, surfaceVertex);
+			normal[affected[i]].normalize();
+		}
+	});
+}
+
+#endif
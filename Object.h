@@ -1,17 +1,35 @@
 #ifndef _OBJECT_H_
 #define _OBJECT_H_
 
+#include "BVH.h"
+#include "Lighting.h"
+#include "MeshOptimizer.h"
+#include "Normals.h"
 #include "projection.h"
+#include "Rasterizer.h"
 #include "Screen.h"
+#include "ShadowMap.h"
+#include "Texture.h"
+#include "ThreadPool.h"
 #include "Transformation.h"
 #include "VertexColorHeader.h"
 #include <SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#define VERTEX_CHUNK 1024 //vertices per parallel job, a multiple of 4 for the SSE lighting
+#define TRIANGLE_BATCH 256 //triangles set up per job ahead of the fill
+#define NEAR_DISTANCE 5 //near plane of the view, nothing is clipped against it
+
 using namespace std;
 
 void replaceAll(std::string& str, const std::string& from, const std::string& to) {
@@ -24,6 +42,85 @@ void replaceAll(std::string& str, const std::string& from, const std::string& to
     }
 }
 
+//reads a face corner written as v, v/vt, v//vn or v/vt/vn, missing indices are 0
+Vertex3D parseFaceCorner(std::string token){
+	replaceAll(token, "/", " / "); //keeps empty fields between two slashes
+	istringstream cstream(token);
+	float index[3] = {0, 0, 0};
+	string field;
+	for(int k = 0; k < 3 && cstream >> field; ){
+		if(field == "/"){ k++; continue; }
+		index[k] = atof(field.c_str());
+	}
+	return Vertex3D(index[0], index[1], index[2]);
+}
+
+//one camera of a batched render: where it stands, the point it looks at and the screen it draws into
+//views of one batch may differ in size, each one needs a screen of its own
+class View
+{
+public:
+	Vertex3D cam, viewPlane;
+	Screen* screen;
+	View():screen(NULL){}
+	View(const Vertex3D& c, const Vertex3D& v, Screen* s):cam(c), viewPlane(v), screen(s){}
+	~View(){}
+};
+
+//what a frame needs before the camera is known, computed once and shared by all of its views
+class FrameLighting
+{
+public:
+	std::vector<LightSource> lights, unshadowed; //all lights, and those without a shadow map
+	Color ambient;
+	bool shared; //diffuse terms are lit once here, views only add their specular light
+	std::vector<Color> diffuse, darkDiffuse; //lit without the specular term, with and without the shadowing lights
+	int shadowCount;
+	const ShadowMap* maps[MAX_SHADOW_LIGHTS];
+	float weight[MAX_SHADOW_LIGHTS]; //share of the shadowed light coming from each map
+	std::vector<float> shadowCoord; //ShadowMap::transform of every vertex, 4 floats per map
+	FrameLighting():shared(false), shadowCount(0){}
+	~FrameLighting(){}
+};
+
+//working memory of a view being drawn: the per-vertex and per-triangle arrays
+class ViewBuffers
+{
+public:
+	std::vector<Color> color, dark; //vertex colors with and without the shadowing lights
+	std::vector<Vertex3D> device; //vertices in device coordinates
+	std::vector<float> w; //clip space w of every vertex
+	std::vector<ShadowVertex> shadowInput;
+	std::vector<TriangleSetup> setup;
+	~ViewBuffers(){}
+};
+
+//view buffers kept from frame to frame, lent to the views while they are drawn
+//there are only as many as views were ever drawn at the same time, so a batch
+//reuses the same few, still warm in the cache, instead of allocating one per view
+class ViewBufferPool
+{
+	std::vector<ViewBuffers*> idle;
+	std::mutex lock;
+public:
+	ViewBufferPool(){}
+	ViewBuffers* acquire(){
+		std::lock_guard<std::mutex> guard(lock);
+		if(idle.empty()) return new ViewBuffers;
+		ViewBuffers* buffers = idle.back();
+		idle.pop_back();
+		return buffers;
+	}
+	void release(ViewBuffers* buffers){
+		std::lock_guard<std::mutex> guard(lock);
+		idle.push_back(buffers);
+	}
+	~ViewBufferPool(){
+		for(unsigned int i = 0; i < idle.size(); i++)
+			delete idle[i];
+	}
+};
+
 class RenderObject
 {
 private:
@@ -34,23 +131,61 @@ private:
 	std::vector<Vertex3D> vertexMatrix;
 	std::vector<Vertex3D> vertexNormal;
 	std::vector<Vertex3D> vertexTexture;
+	std::vector<Material> materials; //materials named by the .mtl library and assignMaterial
+	std::vector<int> surfaceMaterial; //material index of every surface, -1 for the default material
+	std::vector<int> vertexMaterial; //material index of every vertex, taken from the surfaces using it
+	std::vector<Texture> textures; //diffuse map of every material, empty if it has none
+	LightingEngine lighting;
+	NormalBuilder normalBuilder; //faces around each vertex, for normals computed from geometry
+	BVH bvh; //triangle hierarchy for picking, refitted as the model moves once built
+	bool lightingDirty; //geometry or materials changed since the lighting streams were filled
+	unsigned int geometryVersion; //counts changes of the vertex positions, shadow maps keep the one they saw
+	std::vector<ShadowMap> shadowMaps; //one for each of the first MAX_SHADOW_LIGHTS lights
+	int shadowMapSize; //0 while shadows are off
+	ViewBufferPool viewBuffers;
+	int faceMaterial(unsigned int) const;
+	int findMaterial(const string&) const;
+	void prepareFrame(std::vector<LightSource>&, bool, FrameLighting&);
+	void renderView(Screen&, const Vertex3D&, const Vertex3D&, const FrameLighting&);
 public:
 	RenderObject(const string&);
 	bool isInsideTriangle(const Vertex3D&, const Vertex3D&, const Vertex3D&, const Vertex3D&);
-	void gouraudFill(int, int, Vertex3D&, Vertex3D&,LightSource&);
+	void assignMaterial(unsigned int, unsigned int, const Material&);
+	void buildBVH();
+	void gouraudFill(Screen&, Vertex3D&, Vertex3D&, std::vector<LightSource>&);
+	void gouraudFill(int, int, Vertex3D&, Vertex3D&, std::vector<LightSource>&);
+	void gouraudFill(int, int, Vertex3D&, Vertex3D&, LightSource&);
 	void initVertexNormal();
-	void rotate(float, float, float,LightSource&);
-	void scale(float);
+	void moveVertices(const std::vector<unsigned int>&, const std::vector<Vertex3D>&);
+	float nearestDepth(const Vertex3D&, const Vertex3D&) const;
+	void optimizeMeshLayout(MeshStats* = NULL, MeshStats* = NULL);
+	int pick(const Ray&, RayHit* = NULL) const;
+	void pick(const Ray*, RayHit*, unsigned int) const;
+	void recomputeNormals(NormalWeighting = ANGLE_WEIGHTED);
+	void renderViews(std::vector<View>&, std::vector<LightSource>&, const std::function<void(unsigned int)>& = nullptr);
+	void rotate(float, float, float);
+	void scale(float);
+	void setShadows(bool, int = SHADOW_MAP_SIZE);
+	bool setTexture(const string&, const string&);
+	bool setTexture(const string&, const Texture&);
 	void translate(Vertex3D);
-	void sortVertices(ColorVertex&, ColorVertex&, ColorVertex&, ColorVertex&, ColorVertex&, ColorVertex&);
 	~RenderObject(){}
 };
 
+//averages the file's vn normals around every vertex, or computes them from the geometry
+//when the faces carry no normal indices
 void RenderObject::initVertexNormal(){
-	for (int i = 0; i < vertexMatrix.size(); i++)
-		avgVerNormal.push_back({0, 0, 0});
+	normalBuilder.build(surfaceVertex, vertexMatrix.size());
+	bool fileNormals = !vertexNormal.empty();
+	for (unsigned int i = 0; i < surfaceNormal.size() && fileNormals; i++)
+		fileNormals = surfaceNormal[i].x >= 1 && surfaceNormal[i].y >= 1 && surfaceNormal[i].z >= 1;
+	if (!fileNormals){
+		normalBuilder.compute(vertexMatrix, surfaceVertex, avgVerNormal);
+		return;
+	}
 
-	for (int i = 0; i < surfaceVertex.size(); i++){
+	avgVerNormal.assign(vertexMatrix.size(), Vertex3D(0, 0, 0));
+	for (unsigned int i = 0; i < surfaceVertex.size(); i++){
 		int iVertex = surfaceVertex[i].x - 1;
 		int iNormal = surfaceNormal[i].x - 1;
 		Vertex3D normal = vertexNormal[iNormal];
@@ -67,26 +202,133 @@ void RenderObject::initVertexNormal(){
 		avgVerNormal[iVertex] = avgVerNormal[iVertex] + normal;
 	}
 
-	for (int i = 0; i < vertexMatrix.size(); i++)
-		(avgVerNormal[i]/3).normalize();
+	normalizeAll(avgVerNormal);
+}
+
+//replaces smooth normals with ones computed from the current geometry
+void RenderObject::recomputeNormals(NormalWeighting weighting){
+	normalBuilder = NormalBuilder(weighting);
+	normalBuilder.build(surfaceVertex, vertexMatrix.size());
+	normalBuilder.compute(vertexMatrix, surfaceVertex, avgVerNormal);
+	lightingDirty = true;
 }
 
-void RenderObject::sortVertices(ColorVertex& a, ColorVertex& b, ColorVertex& c, ColorVertex& xx, ColorVertex& yy, ColorVertex& zz){
-	if(xx.y <= yy.y && xx.y <= zz.y){
-		a = xx;
-		if(yy.y <= zz.y){	b = yy; c = zz;		}
-		else{	b = zz; c = yy;		}
+//sorts the triangles spatially, reorders them for vertex reuse and renumbers the vertices
+//in first-use order so the per-face gathers walk memory forwards
+//materials assigned by vertex range must be assigned before
+void RenderObject::optimizeMeshLayout(MeshStats* before, MeshStats* after){
+	if(before) *before = meshStats(surfaceVertex);
+	for (int pass = 0; pass < 2; pass++){
+		std::vector<unsigned int> order = pass == 0 ? spatialOrder(surfaceVertex, vertexMatrix)
+			: vertexCacheOrder(surfaceVertex, vertexMatrix.size());
+		applyOrder(surfaceVertex, order);
+		applyOrder(surfaceTexture, order);
+		applyOrder(surfaceNormal, order);
+		applyOrder(surfaceMaterial, order);
 	}
-	else if(yy.y <= xx.y && yy.y <= zz.y){
-		a = yy;
-		if(xx.y <= zz.y){	b = xx; c = zz;		}
-		else{	b = zz; c = xx;		}
+	std::vector<unsigned int> remap = firstUseOrder(surfaceVertex, vertexMatrix.size());
+	for (unsigned int i = 0; i < surfaceVertex.size(); i++){
+		surfaceVertex[i].x = remap[(unsigned int)surfaceVertex[i].x - 1] + 1;
+		surfaceVertex[i].y = remap[(unsigned int)surfaceVertex[i].y - 1] + 1;
+		surfaceVertex[i].z = remap[(unsigned int)surfaceVertex[i].z - 1] + 1;
 	}
-	else{
-		a = zz;
-		if(xx.y <= yy.y){	b = xx; c = yy;		}
-		else{	b = yy; c = xx;		}
+	applyRemap(vertexMatrix, remap);
+	applyRemap(avgVerNormal, remap);
+	applyRemap(vertexMaterial, remap);
+	normalBuilder.build(surfaceVertex, vertexMatrix.size());
+	bvh.build(vertexMatrix, surfaceVertex);
+	geometryVersion++;
+	lightingDirty = true;
+	if(after) *after = meshStats(surfaceVertex);
+}
+
+//moves some vertices and recomputes only the normals around them
+void RenderObject::moveVertices(const std::vector<unsigned int>& index, const std::vector<Vertex3D>& position){
+	for (unsigned int i = 0; i < index.size(); i++)
+		vertexMatrix[index[i]] = position[i];
+	normalBuilder.update(vertexMatrix, surfaceVertex, index, avgVerNormal);
+	bvh.refit(vertexMatrix, surfaceVertex);
+	geometryVersion++;
+	lightingDirty = true;
+}
+
+//rebuilds the triangle hierarchy used by pick, it is built on load and the transformations only refit it
+//so a rebuild can tighten it again after large deformations
+void RenderObject::buildBVH(){
+	bvh.build(vertexMatrix, surfaceVertex);
+}
+
+//index of the nearest surface hit by the ray, -1 if none
+int RenderObject::pick(const Ray& ray, RayHit* hit) const{
+	RayHit nearest;
+	bvh.intersect(ray, nearest);
+	if(hit) *hit = nearest;
+	return nearest.triangle;
+}
+
+//nearest hits of a batch of rays, cast in parallel; a hit's triangle is -1 where its ray hits nothing
+void RenderObject::pick(const Ray* rays, RayHit* hits, unsigned int n) const{
+	bvh.intersect(rays, hits, n);
+}
+
+//distance along the view direction from the camera to the nearest vertex, negative when some vertex is behind it
+//triangles are not clipped at the near plane, a view is only drawn right while this is at least NEAR_DISTANCE
+float RenderObject::nearestDepth(const Vertex3D& cam, const Vertex3D& viewPlane) const{
+	Vertex3D direction = (viewPlane - cam).normalized();
+	float nearest = 1e30f;
+	for (unsigned int i = 0; i < vertexMatrix.size(); i++)
+		nearest = MIN(nearest, (vertexMatrix[i] - cam).dotProduct(direction));
+	return nearest;
+}
+
+//index of the material with the given name, -1 if there is none
+int RenderObject::findMaterial(const string& name) const{
+	for (int i = 0; i < (int)materials.size(); i++)
+		if (materials[i].name == name)
+			return i;
+	return -1;
+}
+
+//material of a surface: the one it was declared with, or else the one assigned to its first vertex
+int RenderObject::faceMaterial(unsigned int i) const{
+	if (surfaceMaterial[i] >= 0)
+		return surfaceMaterial[i];
+	return vertexMaterial[(int)surfaceVertex[i].x - 1];
+}
+
+//turns shadows from the first MAX_SHADOW_LIGHTS lights on or off, size is the side of their maps in texels
+void RenderObject::setShadows(bool on, int size){
+	shadowMapSize = on ? size : 0;
+	if (!on)
+		shadowMaps.clear();
+}
+
+//loads a BMP image as the diffuse map of the named material
+bool RenderObject::setTexture(const string& material, const string& filename){
+	Texture texture;
+	return texture.load(filename) && setTexture(material, texture);
+}
+
+//makes the texture the diffuse map of the named material, surfaces without texture coordinates stay untextured
+bool RenderObject::setTexture(const string& material, const Texture& texture){
+	int m = findMaterial(material);
+	if (m < 0){
+		std::cout<<"Can't find the material "<<material<<".\n";
+		return false;
 	}
+	textures[m] = texture;
+	return true;
+}
+
+//gives vertices [first, last) the material, for models without a material library
+void RenderObject::assignMaterial(unsigned int first, unsigned int last, const Material& mat){
+	materials.push_back(mat);
+	textures.push_back(Texture());
+	if (!mat.diffuseMap.empty())
+		textures.back().load(mat.diffuseMap);
+	for (unsigned int i = first; i < last && i < vertexMaterial.size(); i++)
+		vertexMaterial[i] = materials.size() - 1;
+	lightingDirty = true;
 }
 
 bool RenderObject::isInsideTriangle(const Vertex3D& p, const Vertex3D& a, const Vertex3D& b, const Vertex3D& c){
@@ -97,29 +339,51 @@ bool RenderObject::isInsideTriangle(const Vertex3D& p, const Vertex3D& a, const
 	return (x >= 0 && y >= 0 && z >= 0) || (x < 0 && y < 0 && z < 0);
 }
 
-void RenderObject::rotate(float alpha, float beta, float gamma,LightSource& light){
+void RenderObject::rotate(float alpha, float beta, float gamma){
 	Matrix RinX = rotateX(alpha);
 	Matrix RinY = rotateY(beta);
 	Matrix RinZ = rotateZ(gamma);
 	Matrix temp = RinZ * RinY * RinX;
-	for (int i = 0; i < vertexMatrix.size(); i++)
-		vertexMatrix[i] = temp * vertexMatrix[i];
-	for (int i = 0; i < vertexNormal.size(); i++)
-		vertexNormal[i] = temp * vertexNormal[i];
-    light.pos=temp * light.pos;
+	ThreadPool& pool = ThreadPool::instance();
+	pool.parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+		for (unsigned int i = begin; i < end; i++)
+			vertexMatrix[i] = temp * vertexMatrix[i];
+	});
+	pool.parallelFor(0, vertexNormal.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+		for (unsigned int i = begin; i < end; i++)
+			vertexNormal[i] = temp * vertexNormal[i];
+	});
+	pool.parallelFor(0, avgVerNormal.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+		for (unsigned int i = begin; i < end; i++)
+			avgVerNormal[i] = temp * avgVerNormal[i];
+	});
+	bvh.refit(vertexMatrix, surfaceVertex);
+	geometryVersion++;
+	lightingDirty = true;
 }
-
+
+//uniform scaling keeps the directions of the normalized vertex normals
 void RenderObject::scale(float sf){
-    Matrix temp=scaling(sf);
-    for (int i = 0; i < vertexMatrix.size(); i++)
-		vertexMatrix[i] = temp * vertexMatrix[i];
-}
-
+    Matrix temp=scaling(sf);
+    ThreadPool::instance().parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+		for (unsigned int i = begin; i < end; i++)
+			vertexMatrix[i] = temp * vertexMatrix[i];
+	});
+	bvh.refit(vertexMatrix, surfaceVertex);
+	geometryVersion++;
+	lightingDirty = true;
+}
+
 void RenderObject::translate(Vertex3D vd){
-    Matrix temp=translation(vd);
-    for (int i = 0; i < vertexMatrix.size(); i++)
-		vertexMatrix[i] = temp * vertexMatrix[i];
-}
+    Matrix temp=translation(vd);
+    ThreadPool::instance().parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+		for (unsigned int i = begin; i < end; i++)
+			vertexMatrix[i] = temp * vertexMatrix[i];
+	});
+	bvh.refit(vertexMatrix, surfaceVertex);
+	geometryVersion++;
+	lightingDirty = true;
+}
 
 RenderObject::RenderObject(const string& filename){
 	vertexMatrix.clear();
@@ -129,7 +393,11 @@ RenderObject::RenderObject(const string& filename){
 		throw "Can't open";
 	}
 	std::vector<Vertex3D> temp;
-	string line, keyword;
+	string line, keyword, directory;
+	size_t slash = filename.find_last_of("/\\");
+	if(slash != string::npos)
+		directory = filename.substr(0, slash + 1); //material libraries are relative to the model
+	int currentMaterial = -1;
 	unsigned int vN = 0, vtN = 0, fN = 0, vnN = 0;
 	while(getline(objFile, line)){
 		istringstream linestream(line);
@@ -161,192 +429,234 @@ RenderObject::RenderObject(const string& filename){
 			vtN++;
 		}
 		else if(keyword == "f"){
-			replaceAll(line,"/"," "); //replaces '/' with <space>
-			istringstream lstream(line);
-			Vertex3D ver, tex, nor;
-			lstream >> ver.x;	lstream >> tex.x;	lstream >> nor.x;
-			lstream >> ver.y;	lstream >> tex.y;	lstream >> nor.y;
-			lstream >> ver.z;	lstream >> tex.z;	lstream >> nor.z;
-			surfaceVertex.push_back(ver); surfaceTexture.push_back(tex); surfaceNormal.push_back(nor);//add new surface to the surface vector
-			fN++;
+			std::vector<Vertex3D> corner; //vertex, texture and normal index of every corner
+			string token;
+			while(linestream >> token)
+				corner.push_back(parseFaceCorner(token));
+			//polygons are split into a fan of triangles
+			for(unsigned int k = 2; k < corner.size(); k++){
+				Vertex3D ver(corner[0].x, corner[k-1].x, corner[k].x);
+				Vertex3D tex(corner[0].y, corner[k-1].y, corner[k].y);
+				Vertex3D nor(corner[0].z, corner[k-1].z, corner[k].z);
+				surfaceVertex.push_back(ver); surfaceTexture.push_back(tex); surfaceNormal.push_back(nor);//add new surface to the surface vector
+				surfaceMaterial.push_back(currentMaterial);
+				fN++;
+			}
+		}
+		else if(keyword == "mtllib"){
+			string library;
+			linestream >> library;
+			loadMaterialLibrary(directory + library, materials);
 		}
+		else if(keyword == "usemtl"){
+			string name;
+			linestream >> name;
+			currentMaterial = findMaterial(name); //unknown materials use the default one
+		}
+	}
+	textures.resize(materials.size());
+	for(unsigned int i = 0; i < materials.size(); i++)
+		if(!materials[i].diffuseMap.empty())
+			textures[i].load(materials[i].diffuseMap);
+	vertexMaterial.assign(vertexMatrix.size(), -1);
+	for(unsigned int i = 0; i < surfaceVertex.size(); i++){
+		vertexMaterial[(int)surfaceVertex[i].x - 1] = surfaceMaterial[i];
+		vertexMaterial[(int)surfaceVertex[i].y - 1] = surfaceMaterial[i];
+		vertexMaterial[(int)surfaceVertex[i].z - 1] = surfaceMaterial[i];
 	}
+	lightingDirty = true;
+	geometryVersion = 0;
+	shadowMapSize = 0;
 	initVertexNormal();
+	bvh.build(vertexMatrix, surfaceVertex);
 }
 
-void RenderObject::gouraudFill(int width, int height, Vertex3D& cam, Vertex3D& viewPlane,LightSource& light){
+void RenderObject::gouraudFill(int width, int height, Vertex3D& cam, Vertex3D& viewPlane, LightSource& light){
+	std::vector<LightSource> lights(1, light);
+	gouraudFill(width, height, cam, viewPlane, lights);
+}
 
+//renders to the window and presents the frame
+void RenderObject::gouraudFill(int width, int height, Vertex3D& cam, Vertex3D& viewPlane, std::vector<LightSource>& lights){
     SDL_WM_SetCaption("Cricket Pitch", NULL);
     Screen Pitch(width, height);
     Pitch.clear();
+    gouraudFill(Pitch, cam, viewPlane, lights);
+    Pitch.refresh();
+}
 
-    Color ia(0.3,0.3,0.3), ks(0.1, 0.1, 0.1), kd(0.5, 0.5, 0.5), ka(0.5, 0.5, 0.5);
-	std::vector<LightSource> lighta;
-	lighta.push_back(light);
-
-    Color ColorIntensity[vertexMatrix.size()];
-    for(unsigned int ii = 0; ii < vertexMatrix.size(); ii++){
-    	//get three vertices of the surface
-
-		Vertex3D n = avgVerNormal[ii];
-		Vertex3D centroid = vertexMatrix[ii];
-
-		float intensityR = ia.r*ka.r, intensityG = ia.g*ka.g, intensityB = ia.b*ka.b;
-		for(int i = 0; i < lighta.size(); i++){
-
-			float costheta = (lighta[i].pos).cosine(n);
-			if(costheta > 0){
-                    if(ii<8){
-				intensityR += lighta[i].Intensity.r*kd.r*costheta*0;
-				intensityG += lighta[i].Intensity.g*kd.g*costheta+1;
-				intensityB += lighta[i].Intensity.b*kd.b*costheta*0;}
-
-			else if (ii>=8 && ii<390)
-            {
-                intensityR += lighta[i].Intensity.r*kd.r*costheta+1;
-				intensityG += lighta[i].Intensity.g*kd.g*costheta*0;
-				intensityB += lighta[i].Intensity.b*kd.b*costheta*0;}
-
-            else
-            {
-                intensityR += lighta[i].Intensity.r*kd.r*costheta*0;
-				intensityG += lighta[i].Intensity.g*kd.g*costheta*0;
-				intensityB += lighta[i].Intensity.b*kd.b*costheta+1;}
-            }
-		}
-		ColorIntensity[ii] = Color(intensityR, intensityG, intensityB);
-	}
+//renders into a cleared screen without presenting it
+void RenderObject::gouraudFill(Screen& Pitch, Vertex3D& cam, Vertex3D& viewPlane, std::vector<LightSource>& lights){
+	FrameLighting frame;
+	prepareFrame(lights, false, frame);
+	renderView(Pitch, cam, viewPlane, frame);
+}
 
-    float near = 5, far = 0xffffff;
-    Vertex3D v3[vertexMatrix.size()], lightView[vertexMatrix.size()];
-    for(int i = 0; i < vertexMatrix.size(); i++){
-        v3[i] = perspective(vertexMatrix[i], cam, viewPlane, near, far, width, height); //conversion to device coordinate
-    }
-    for(unsigned int i = 0; i < surfaceVertex.size(); i++){
-
-    	//get three vertices of the surface
-    	unsigned int x = (unsigned int) surfaceVertex[i].x - 1;
-    	unsigned int y = (unsigned int) surfaceVertex[i].y - 1;
-    	unsigned int z = (unsigned int) surfaceVertex[i].z - 1;
-		ColorVertex a(v3[x], ColorIntensity[x]);
-		ColorVertex b(v3[y], ColorIntensity[y]);
-		ColorVertex c(v3[z], ColorIntensity[z]);
-
-		Vertex3D n = (v3[y] - v3[x]).crossProduct(v3[z] - v3[y])*-1;
-		float d = -(a.x*n.x + a.y*n.y + a.z*n.z);
-
-		ColorVertex A, B, C;
-		sortVertices(A, B, C, a, b, c);
-
-		if (A.y == C.y) continue;
-		if (A.y >= height || C.y < 0) continue;
-
-		float dx1, dx2, dx3;
-		float dr1, dr2, dr3;
-		float dg1, dg2, dg3;
-		float db1, db2, db3;
-		float dr, dg, db;
-
-		if (B.y > A.y){
-			dx1 = (B.x - A.x) / (B.y - A.y);
-			dr1 = (B.col.r - A.col.r) / (B.y - A.y);
-			dg1 = (B.col.g - A.col.g) / (B.y - A.y);
-			db1 = (B.col.b - A.col.b) / (B.y - A.y);
-		}else dx1 = dr1 = dg1 = db1 = 0;
-
-		if (C.y > A.y){
-			dx2 = (C.x - A.x) / (C.y - A.y);
-			dr2 = (C.col.r - A.col.r) / (C.y - A.y);
-			dg2 = (C.col.g - A.col.g) / (C.y - A.y);
-			db2 = (C.col.b - A.col.b) / (C.y - A.y);
-		}else dx2 = dr2 = dg2 = db2 = 0;
-
-		if (C.y > B.y){
-			dx3 = (C.x - B.x) / (C.y - B.y);
-			dr3 = (C.col.r - B.col.r) / (C.y - B.y);
-			dg3 = (C.col.g - B.col.g) / (C.y - B.y);
-			db3 = (C.col.b - B.col.b) / (C.y - B.y);
-		}else dx3 = dr3 = dg3 = db3 = 0;
-
-		ColorVertex S = A;
-		ColorVertex E = A;
-
-		if (dx1 > dx2){
-			for(; S.y <= B.y; S.y++, E.y++){
-				if(E.x > S.x){
-					dr = (E.col.r - S.col.r) / (E.x - S.x);
-					dg = (E.col.g - S.col.g) / (E.x - S.x);
-					db = (E.col.b - S.col.b) / (E.x - S.x);
-				}else dr = dg = db = 0;
-
-				ColorVertex P = S;
-				for (; P.x < E.x; P.x++){
-					float depth = -(n.x*P.x + n.y*P.y + d) / n.z;
-					Pitch.setPixel(P.x, P.y, -depth, P.col);
-					P.col.r += dr; P.col.g += dg;  P.col.b += db;
-				}
-				S.x += dx2; S.col.r += dr2; S.col.g += dg2; S.col.b += db2;
-				E.x += dx1; E.col.r += dr1; E.col.g += dg1; E.col.b += db1;
-			}
+//renders the object from every view for the same lights, into their cleared screens
+//the lighting terms that do not depend on the eye, the shadow maps and the light space
+//coordinates are computed once for the batch, then the views are drawn concurrently
+//finished, when given, is called with the index of every view as soon as it is drawn, on the
+//thread that drew it, so the frame can be read while it is still in the cache
+void RenderObject::renderViews(std::vector<View>& views, std::vector<LightSource>& lights,
+	const std::function<void(unsigned int)>& finished){
+	FrameLighting frame;
+	prepareFrame(lights, views.size() > 1, frame);
+	ThreadPool& pool = ThreadPool::instance();
+	TaskGroup group;
+	for(unsigned int i = 0; i < views.size(); i++){
+		if(views[i].screen == NULL) continue;
+		pool.run(group, [&, i]{
+			renderView(*views[i].screen, views[i].cam, views[i].viewPlane, frame);
+			if(finished) finished(i);
+		});
+	}
+	pool.wait(group);
+}
 
-			E = B;
-			for(; S.y <= C.y; S.y++, E.y++){
-				if(E.x > S.x){
-					dr = (E.col.r - S.col.r) / (E.x - S.x);
-					dg = (E.col.g - S.col.g) / (E.x - S.x);
-					db = (E.col.b - S.col.b) / (E.x - S.x);
-				}else dr = dg = db = 0;
-
-				ColorVertex P = S;
-				for(; P.x < E.x; P.x++){
-					float depth = -(n.x*P.x + n.y*P.y + d) / n.z;
-					Pitch.setPixel(P.x, P.y, -depth, P.col);
-					P.col.r += dr; P.col.g += dg;  P.col.b += db;
-				}
-				S.x += dx2; S.col.r += dr2; S.col.g += dg2; S.col.b += db2;
-				E.x += dx3; E.col.r += dr3; E.col.g += dg3; E.col.b += db3;
-			}
-		}
-		else{
-			for(; S.y <= B.y; S.y++, E.y++){
-				if(E.x > S.x){
-					dr = (E.col.r - S.col.r) / (E.x - S.x);
-					dg = (E.col.g - S.col.g) / (E.x - S.x);
-					db = (E.col.b - S.col.b) / (E.x - S.x);
-				}else dr = dg = db = 0;
-
-				ColorVertex P = S;
-				for (; P.x < E.x; P.x++){
-					float depth = -(n.x*P.x + n.y*P.y + d) / n.z;
-					Pitch.setPixel(P.x, P.y, -depth, P.col);
-					P.col.r += dr; P.col.g += dg;  P.col.b += db;
-				}
-				S.x += dx1; S.col.r += dr1; S.col.g += dg1; S.col.b += db1;
-				E.x += dx2; E.col.r += dr2; E.col.g += dg2; E.col.b += db2;
-			}
+//the camera independent part of a frame: lighting streams, shadow maps and, when views share
+//them, the diffuse terms of the vertex lighting
+void RenderObject::prepareFrame(std::vector<LightSource>& lights, bool shared, FrameLighting& frame){
+	frame.lights = lights;
+	frame.ambient = Color(0.3, 0.3, 0.3);
+	frame.shared = shared;
+	if(lightingDirty){
+		lighting.setGeometry(vertexMatrix, avgVerNormal);
+		lighting.setMaterials(materials, vertexMaterial);
+		lightingDirty = false;
+	}
+	ThreadPool& pool = ThreadPool::instance();
+	Vertex3D noEye(0, 0, 0); //the diffuse terms do not look at it
+	if(shared){
+		frame.diffuse.resize(vertexMatrix.size());
+		pool.parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+			lighting.shade(lights, noEye, frame.ambient, &frame.diffuse[0], begin, end, DIFFUSE_TERMS);
+		});
+	}
 
-			S = B;
-			for(; S.y <= C.y; S.y++, E.y++){
-				if(E.x > S.x){
-					dr = (E.col.r - S.col.r) / (E.x - S.x);
-					dg = (E.col.g - S.col.g) / (E.x - S.x);
-					db = (E.col.b - S.col.b) / (E.x - S.x);
-				}else dr = dg = db = 0;
-
-				ColorVertex P = S;
-				// std::cout<<P.x<<"\t"<<S.x<<"\t"<<E.x<<"\n";
-				for(; P.x < E.x; P.x++){
-					float depth = -(n.x*P.x + n.y*P.y + d) / n.z;
-					Pitch.setPixel(P.x, P.y, -depth, P.col);
-					P.col.r += dr; P.col.g += dg;  P.col.b += db;
-				}
-				S.x += dx3; S.col.r += dr3; S.col.g += dg3; S.col.b += db3;
-				E.x += dx2; E.col.r += dr2; E.col.g += dg2; E.col.b += db2;
-			}
-		}
+	//the first lights cast shadows: their maps are brought up to date and every vertex is placed
+	//in them, the shadowed pixels are lit again without these lights
+	frame.shadowCount = shadowMapSize > 0 ? MIN((int)lights.size(), MAX_SHADOW_LIGHTS) : 0;
+	if(frame.shadowCount == 0) return;
+	int shadowCount = frame.shadowCount;
+	float total = 0;
+	shadowMaps.resize(shadowCount);
+	for(int k = 0; k < shadowCount; k++){
+		shadowMaps[k].update(vertexMatrix, surfaceVertex, lights[k], geometryVersion, shadowMapSize);
+		frame.maps[k] = &shadowMaps[k];
+		frame.weight[k] = lights[k].Intensity.r + lights[k].Intensity.g + lights[k].Intensity.b;
+		total += frame.weight[k];
 	}
+	for(int k = 0; k < shadowCount; k++)
+		frame.weight[k] = total > 0 ? frame.weight[k] / total : 1.0f / shadowCount;
+	frame.unshadowed.assign(lights.begin() + shadowCount, lights.end());
+	frame.shadowCoord.resize(vertexMatrix.size() * 4 * shadowCount);
+	if(shared) frame.darkDiffuse.resize(vertexMatrix.size());
+	pool.parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++)
+			for(int k = 0; k < shadowCount; k++)
+				shadowMaps[k].transform(vertexMatrix[i], &frame.shadowCoord[(i*shadowCount + k)*4]);
+		if(shared)
+			lighting.shade(frame.unshadowed, noEye, frame.ambient, &frame.darkDiffuse[0], begin, end, DIFFUSE_TERMS);
+	});
+}
 
-    Pitch.refresh();
+//draws one view of a prepared frame, views of the same frame may be drawn at the same time
+void RenderObject::renderView(Screen& Pitch, const Vertex3D& cam, const Vertex3D& viewPlane, const FrameLighting& frame){
+    ViewBuffers& buffers = *viewBuffers.acquire();
+    int width = Pitch.width(), height = Pitch.height();
+    int shadowCount = frame.shadowCount;
+    ThreadPool& pool = ThreadPool::instance();
+    //vertex colors: the shared diffuse terms plus this eye's specular light, or the full lighting
+    std::vector<Color>& ColorIntensity = buffers.color;
+    std::vector<Color>& darkIntensity = buffers.dark;
+    ColorIntensity.resize(vertexMatrix.size());
+    darkIntensity.resize(shadowCount > 0 ? vertexMatrix.size() : 0);
+    pool.parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+    	if(frame.shared){
+    		std::copy(frame.diffuse.begin() + begin, frame.diffuse.begin() + end, ColorIntensity.begin() + begin);
+    		lighting.shade(frame.lights, cam, frame.ambient, &ColorIntensity[0], begin, end, SPECULAR_TERMS);
+    	}
+    	else lighting.shade(frame.lights, cam, frame.ambient, &ColorIntensity[0], begin, end);
+    	if(shadowCount == 0) return;
+    	if(frame.shared){
+    		std::copy(frame.darkDiffuse.begin() + begin, frame.darkDiffuse.begin() + end, darkIntensity.begin() + begin);
+    		lighting.shade(frame.unshadowed, cam, frame.ambient, &darkIntensity[0], begin, end, SPECULAR_TERMS);
+    	}
+    	else lighting.shade(frame.unshadowed, cam, frame.ambient, &darkIntensity[0], begin, end);
+    });
+
+    float near = NEAR_DISTANCE, far = 0xffffff;
+    Matrix transformer = viewingTransform(cam, viewPlane, near, far, width, height);
+    std::vector<Vertex3D>& v3 = buffers.device;
+    std::vector<float>& w = buffers.w;
+    std::vector<ShadowVertex>& shadowInput = buffers.shadowInput;
+    v3.resize(vertexMatrix.size());
+    w.resize(vertexMatrix.size());
+    shadowInput.resize(shadowCount > 0 ? vertexMatrix.size() : 0);
+    pool.parallelFor(0, vertexMatrix.size(), VERTEX_CHUNK, [&](unsigned int begin, unsigned int end){
+    	for(unsigned int i = begin; i < end; i++){
+    		v3[i] = project(transformer, vertexMatrix[i], &w[i]); //conversion to device coordinate
+    		if(shadowCount == 0) continue;
+    		ShadowVertex& sv = shadowInput[i];
+    		sv.dark = darkIntensity[i];
+    		sv.q = 1 / w[i];
+    		for(int k = 0; k < shadowCount; k++)
+    			for(int j = 0; j < 4; j++)
+    				sv.coord[k][j] = frame.shadowCoord[(i*shadowCount + k)*4 + j] * sv.q;
+    	}
+    });
+
+    //triangle setup runs ahead in batches on the pool while this thread fills the finished ones
+    unsigned int nTriangle = surfaceVertex.size();
+    unsigned int nBatch = (nTriangle + TRIANGLE_BATCH - 1) / TRIANGLE_BATCH;
+    std::vector<TriangleSetup>& setup = buffers.setup;
+    setup.resize(nTriangle);
+    std::unique_ptr<std::atomic<bool>[]> ready(new std::atomic<bool>[nBatch]);
+    TaskGroup group;
+    for(unsigned int b = 0; b < nBatch; b++){
+    	ready[b] = false;
+    	pool.run(group, [&, b]{
+    		unsigned int end = MIN(nTriangle, (b + 1) * TRIANGLE_BATCH);
+    		for(unsigned int i = b * TRIANGLE_BATCH; i < end; i++){
+    			//get three vertices of the surface
+    			unsigned int x = (unsigned int) surfaceVertex[i].x - 1;
+    			unsigned int y = (unsigned int) surfaceVertex[i].y - 1;
+    			unsigned int z = (unsigned int) surfaceVertex[i].z - 1;
+    			//textured surfaces interpolate u/w, v/w and 1/w, OBJ texture coordinates start at the bottom
+    			int m = faceMaterial(i);
+    			const Texture* texture = NULL;
+    			Vertex3D uvq[3];
+    			if(m >= 0 && !textures[m].empty() && surfaceTexture[i].x >= 1 && surfaceTexture[i].y >= 1 && surfaceTexture[i].z >= 1){
+    				texture = &textures[m];
+    				unsigned int corner[3] = {x, y, z};
+    				float tex[3] = {surfaceTexture[i].x, surfaceTexture[i].y, surfaceTexture[i].z};
+    				for(int k = 0; k < 3; k++){
+    					const Vertex3D& uv = vertexTexture[(unsigned int)tex[k] - 1];
+    					uvq[k] = Vertex3D(uv.x, 1 - uv.y, 1) / w[corner[k]];
+    				}
+    			}
+    			ColorVertex a(v3[x], ColorIntensity[x]), b(v3[y], ColorIntensity[y]), c(v3[z], ColorIntensity[z]);
+    			setupTriangle(setup[i], a, b, c, height, texture, uvq);
+    			if(shadowCount > 0 && setup[i].visible){
+    				ShadowVertex corner[3] = {shadowInput[x], shadowInput[y], shadowInput[z]};
+    				setupShadows(setup[i], a, b, c, corner, frame.maps, frame.weight, shadowCount);
+    			}
+    		}
+    		ready[b] = true;
+    	});
+    }
+    //on a worker the batches sit on its own deque, they are taken oldest first so that batch b
+    //is set up next rather than after all the later ones
+    //a batch that threw is never ready, the fill stops and the wait below rethrows
+    for(unsigned int b = 0; b < nBatch; b++){
+    	pool.waitUntil([&]{ return ready[b].load() || group.failed(); }, true);
+    	if(!ready[b]) break;
+    	unsigned int end = MIN(nTriangle, (b + 1) * TRIANGLE_BATCH);
+    	for(unsigned int i = b * TRIANGLE_BATCH; i < end; i++)
+    		rasterTriangle(Pitch, setup[i]);
+    }
+    pool.wait(group);
+    viewBuffers.release(&buffers);
 }
 
 #endif
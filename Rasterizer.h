@@ -0,0 +1,374 @@
+#ifndef _RASTERIZER_H_
+#define _RASTERIZER_H_
+
+#include "Screen.h"
+#include "ShadowMap.h"
+#include "Texture.h"
+#include "VertexColorHeader.h"
+#include <cmath>
+
+#define TEXTURE_RUN 16 //pixels between exact perspective divides along a textured span
+
+//per scanline increments of an edge: x and color
+class EdgeStep
+{
+public:
+	float dx, dr, dg, db;
+	EdgeStep():dx(0), dr(0), dg(0), db(0){}
+	//increments going from a to b, one scanline at a time
+	EdgeStep(const ColorVertex& a, const ColorVertex& b){
+		if(b.y > a.y){
+			dx = (b.x - a.x) / (b.y - a.y);
+			dr = (b.col.r - a.col.r) / (b.y - a.y);
+			dg = (b.col.g - a.col.g) / (b.y - a.y);
+			db = (b.col.b - a.col.b) / (b.y - a.y);
+		}else dx = dr = dg = db = 0;
+	}
+	~EdgeStep(){}
+};
+
+//everything the scanline loop needs about one triangle
+//computed apart from the fill so that setup can run ahead on other threads
+class TriangleSetup
+{
+public:
+	ColorVertex A, B, C; //vertices sorted top to bottom
+	EdgeStep e1, e2, e3; //edges A->B, A->C and B->C
+	Vertex3D n; //plane normal in device space
+	float d; //plane offset, depth = -(n.x*x + n.y*y + d) / n.z
+	const Texture* texture; //NULL for a triangle that is only Gouraud shaded
+	float s[3], t[3], q[3]; //u/w, v/w and 1/w over the screen, as [0]*x + [1]*y + [2]
+	int shadows; //shadow maps tested per pixel
+	const ShadowMap* shadowMap[MAX_SHADOW_LIGHTS];
+	float shadowWeight[MAX_SHADOW_LIGHTS]; //share of the shadowed light coming from each map
+	float shadowCoord[MAX_SHADOW_LIGHTS][4][3]; //texel x, y, w and depth of each map over w
+	float dark[3][3]; //color planes with the light of the shadow maps taken out
+	bool visible;
+	TriangleSetup():d(0), texture(NULL), shadows(0), visible(false){}
+	~TriangleSetup(){}
+};
+
+//what a vertex needs for per-pixel shadows, coordinates already divided by its w
+class ShadowVertex
+{
+public:
+	Color dark; //lit color without the lights that have shadow maps
+	float q; //1/w
+	float coord[MAX_SHADOW_LIGHTS][4]; //ShadowMap::transform of the vertex over w
+	ShadowVertex():q(0){}
+	~ShadowVertex(){}
+};
+
+//orders xx, yy and zz by y into a, b and c
+void sortVertices(ColorVertex& a, ColorVertex& b, ColorVertex& c, ColorVertex& xx, ColorVertex& yy, ColorVertex& zz){
+	if(xx.y <= yy.y && xx.y <= zz.y){
+		a = xx;
+		if(yy.y <= zz.y){	b = yy; c = zz;		}
+		else{	b = zz; c = yy;		}
+	}
+	else if(yy.y <= xx.y && yy.y <= zz.y){
+		a = yy;
+		if(xx.y <= zz.y){	b = xx; c = zz;		}
+		else{	b = zz; c = xx;		}
+	}
+	else{
+		a = zz;
+		if(xx.y <= yy.y){	b = xx; c = yy;		}
+		else{	b = yy; c = xx;		}
+	}
+}
+
+//coefficients of the screen space plane through the values fa, fb and fc at the vertices
+void screenPlane(float* plane, const ColorVertex& a, const ColorVertex& b, const ColorVertex& c, float fa, float fb, float fc){
+	float det = (b.x - a.x)*(c.y - a.y) - (c.x - a.x)*(b.y - a.y);
+	if(det == 0){ plane[0] = plane[1] = 0; plane[2] = fa; return; }
+	plane[0] = ((fb - fa)*(c.y - a.y) - (fc - fa)*(b.y - a.y)) / det;
+	plane[1] = ((fc - fa)*(b.x - a.x) - (fb - fa)*(c.x - a.x)) / det;
+	plane[2] = fa - plane[0]*a.x - plane[1]*a.y;
+}
+
+//adds per-pixel shadows from the maps to a triangle, with the shadow inputs of a, b and c in sv
+void setupShadows(TriangleSetup& t, const ColorVertex& a, const ColorVertex& b, const ColorVertex& c,
+	const ShadowVertex* sv, const ShadowMap* const* maps, const float* weight, int count){
+	t.shadows = MIN(count, MAX_SHADOW_LIGHTS);
+	if(t.shadows == 0) return;
+	screenPlane(t.q, a, b, c, sv[0].q, sv[1].q, sv[2].q);
+	screenPlane(t.dark[0], a, b, c, sv[0].dark.r, sv[1].dark.r, sv[2].dark.r);
+	screenPlane(t.dark[1], a, b, c, sv[0].dark.g, sv[1].dark.g, sv[2].dark.g);
+	screenPlane(t.dark[2], a, b, c, sv[0].dark.b, sv[1].dark.b, sv[2].dark.b);
+	for(int k = 0; k < t.shadows; k++){
+		t.shadowMap[k] = maps[k];
+		t.shadowWeight[k] = weight[k];
+		for(int j = 0; j < 4; j++)
+			screenPlane(t.shadowCoord[k][j], a, b, c, sv[0].coord[k][j], sv[1].coord[k][j], sv[2].coord[k][j]);
+	}
+}
+
+//sorts the vertices and computes the edge increments of a device space triangle
+//a textured triangle also takes u/w, v/w and 1/w of every vertex, which are linear on the screen
+void setupTriangle(TriangleSetup& t, ColorVertex a, ColorVertex b, ColorVertex c, int height,
+	const Texture* texture = NULL, const Vertex3D* uvq = NULL){
+	Vertex3D pa(a.x, a.y, a.z), pb(b.x, b.y, b.z), pc(c.x, c.y, c.z);
+	t.n = (pb - pa).crossProduct(pc - pb)*-1;
+	t.d = -(a.x*t.n.x + a.y*t.n.y + a.z*t.n.z);
+	t.texture = texture && uvq ? texture : NULL;
+	t.shadows = 0; //setupShadows adds them
+	if(t.texture){
+		screenPlane(t.s, a, b, c, uvq[0].x, uvq[1].x, uvq[2].x);
+		screenPlane(t.t, a, b, c, uvq[0].y, uvq[1].y, uvq[2].y);
+		screenPlane(t.q, a, b, c, uvq[0].z, uvq[1].z, uvq[2].z);
+	}
+
+	sortVertices(t.A, t.B, t.C, a, b, c);
+	t.visible = !(t.A.y == t.C.y || t.A.y >= height || t.C.y < 0);
+	if(!t.visible) return;
+
+	t.e1 = EdgeStep(t.A, t.B);
+	t.e2 = EdgeStep(t.A, t.C);
+	t.e3 = EdgeStep(t.B, t.C);
+}
+
+//the lit color at (x, y) with the light of every shadow map blocked as far as the map sees
+//something nearer to the light than the pixel
+inline Color shadowedColor(const TriangleSetup& t, const Color& lit, float x, float y){
+	float q = t.q[0]*x + t.q[1]*y + t.q[2];
+	float light = 0;
+	for(int k = 0; k < t.shadows; k++){
+		float h[4];
+		for(int j = 0; j < 4; j++)
+			h[j] = t.shadowCoord[k][j][0]*x + t.shadowCoord[k][j][1]*y + t.shadowCoord[k][j][2];
+		light += t.shadowWeight[k] * t.shadowMap[k]->visibility(h[0]/h[2], h[1]/h[2], h[3]/q);
+	}
+	if(light >= 1) return lit;
+	float r = t.dark[0][0]*x + t.dark[0][1]*y + t.dark[0][2];
+	float g = t.dark[1][0]*x + t.dark[1][1]*y + t.dark[1][2];
+	float b = t.dark[2][0]*x + t.dark[2][1]*y + t.dark[2][2];
+	return Color(r + (lit.r - r)*light, g + (lit.g - g)*light, b + (lit.b - b)*light);
+}
+
+//fills the span from P to xEnd with the per-pixel work on top of the Gouraud color:
+//shadows take the blocked light out, then the texture is multiplied in
+//u and v are divided exactly every TEXTURE_RUN pixels and stepped linearly in between,
+//and the whole span samples the one mip level chosen in its middle
+void shadedSpan(Screen& screen, const TriangleSetup& t, ColorVertex P, float xEnd, float dr, float dg, float db){
+	const Texture* tex = t.texture;
+	//nothing is shaded for pixels off the screen
+	if((int)P.y < 0 || (int)P.y >= screen.height()) return;
+	if(P.x < 0){
+		float skip = ceilf(-P.x);
+		P.x += skip;
+		P.col.r += dr*skip; P.col.g += dg*skip; P.col.b += db*skip;
+	}
+	xEnd = MIN(xEnd, (float)screen.width());
+	if(P.x >= xEnd) return;
+	int level = 0;
+	float u = 0, v = 0, q;
+	if(tex){
+		float xm = (P.x + xEnd) / 2;
+		q = t.q[0]*xm + t.q[1]*P.y + t.q[2];
+		u = (t.s[0]*xm + t.s[1]*P.y + t.s[2]) / q;
+		v = (t.t[0]*xm + t.t[1]*P.y + t.t[2]) / q;
+		//derivatives of u = s/q and v = t/q along x and y
+		level = tex->levelOf((t.s[0] - u*t.q[0]) / q, (t.t[0] - v*t.q[0]) / q, (t.s[1] - u*t.q[1]) / q, (t.t[1] - v*t.q[1]) / q);
+		q = t.q[0]*P.x + t.q[1]*P.y + t.q[2];
+		u = (t.s[0]*P.x + t.s[1]*P.y + t.s[2]) / q;
+		v = (t.t[0]*P.x + t.t[1]*P.y + t.t[2]) / q;
+	}
+	while(P.x < xEnd){
+		int run = MIN(TEXTURE_RUN, (int)ceilf(xEnd - P.x));
+		float u1 = 0, v1 = 0, du = 0, dv = 0;
+		if(tex){
+			float x1 = P.x + run;
+			float q1 = t.q[0]*x1 + t.q[1]*P.y + t.q[2];
+			u1 = (t.s[0]*x1 + t.s[1]*P.y + t.s[2]) / q1;
+			v1 = (t.t[0]*x1 + t.t[1]*P.y + t.t[2]) / q1;
+			du = (u1 - u) / run; dv = (v1 - v) / run;
+		}
+		for(int k = 0; k < run; k++){
+			float depth = -(t.n.x*P.x + t.n.y*P.y + t.d) / t.n.z;
+			if(screen.visible(P.x, P.y, -depth)){ //hidden pixels are not shaded
+				Color c = t.shadows ? shadowedColor(t, P.col, P.x, P.y) : P.col;
+				if(tex){
+					Color texel = tex->sample(u, v, level);
+					c = Color(c.r*texel.r, c.g*texel.g, c.b*texel.b);
+				}
+				screen.setPixel(P.x, P.y, -depth, c);
+			}
+			P.x++; u += du; v += dv;
+			P.col.r += dr; P.col.g += dg;  P.col.b += db;
+		}
+		u = u1; v = v1;
+	}
+}
+
+//fills scanlines from S.y to yEnd, stepping the left edge S by ls and the right edge E by rs
+void fillSpans(Screen& screen, const TriangleSetup& t, ColorVertex& S, ColorVertex& E, const EdgeStep& ls, const EdgeStep& rs, float yEnd){
+	float dr, dg, db;
+	for(; S.y <= yEnd; S.y++, E.y++){
+		if(E.x > S.x){
+			dr = (E.col.r - S.col.r) / (E.x - S.x);
+			dg = (E.col.g - S.col.g) / (E.x - S.x);
+			db = (E.col.b - S.col.b) / (E.x - S.x);
+		}else dr = dg = db = 0;
+
+		ColorVertex P = S;
+		if(t.texture || t.shadows) shadedSpan(screen, t, P, E.x, dr, dg, db);
+		else for (; P.x < E.x; P.x++){
+			float depth = -(t.n.x*P.x + t.n.y*P.y + t.d) / t.n.z;
+			screen.setPixel(P.x, P.y, -depth, P.col);
+			P.col.r += dr; P.col.g += dg;  P.col.b += db;
+		}
+		S.x += ls.dx; S.col.r += ls.dr; S.col.g += ls.dg; S.col.b += ls.db;
+		E.x += rs.dx; E.col.r += rs.dr; E.col.g += rs.dg; E.col.b += rs.db;
+	}
+}
+
+//point of the edge starting at v on scanline y, which the other edge has already reached
+ColorVertex edgeAt(ColorVertex v, const EdgeStep& e, float y){
+	float dy = y - v.y;
+	v.x += e.dx*dy; v.col.r += e.dr*dy; v.col.g += e.dg*dy; v.col.b += e.db*dy;
+	v.y = y;
+	return v;
+}
+
+//one edge of a multisampled triangle as e = c + dx*x + dy*y, positive inside
+class EdgeFunction
+{
+public:
+	float c, dx, dy;
+	bool topLeft; //samples exactly on the edge belong to this triangle, not to its neighbour
+	EdgeFunction():c(0), dx(0), dy(0), topLeft(false){}
+	//edge from a to b with the inside on the side that makes area positive
+	EdgeFunction(const ColorVertex& a, const ColorVertex& b, float area){
+		float ex = b.x - a.x, ey = b.y - a.y;
+		if(area < 0){ ex = -ex; ey = -ey; }
+		dx = -ey; dy = ex;
+		c = -(dx*a.x + dy*a.y);
+		topLeft = dx > 0 || (dx == 0 && dy > 0); //a left edge, or a horizontal one with the inside below
+	}
+	bool inside(float e) const {return e > 0 || (e == 0 && topLeft);}
+	~EdgeFunction(){}
+};
+
+//x range covered by the triangle between the scanlines y and y + 1, empty if lo > hi
+void rowExtent(const TriangleSetup& t, float y, float& lo, float& hi){
+	const ColorVertex* v[3][2] = {{&t.A, &t.B}, {&t.B, &t.C}, {&t.A, &t.C}};
+	lo = 1e30f; hi = -1e30f;
+	for(int k = 0; k < 3; k++){
+		const ColorVertex& a = *v[k][0];
+		const ColorVertex& b = *v[k][1];
+		float y0 = MAX(a.y, y), y1 = MIN(b.y, y + 1);
+		if(y0 > y1) continue;
+		float slope = b.y > a.y ? (b.x - a.x) / (b.y - a.y) : 0;
+		float x0 = b.y > a.y ? a.x + slope*(y0 - a.y) : MIN(a.x, b.x);
+		float x1 = b.y > a.y ? a.x + slope*(y1 - a.y) : MAX(a.x, b.x);
+		lo = MIN(lo, MIN(x0, x1)); hi = MAX(hi, MAX(x0, x1));
+	}
+}
+
+//fills a triangle into a multisampled screen: every pixel the triangle touches gets a mask of
+//the samples inside it, the samples that pass the depth test are counted and, if any are
+//left, the pixel is shaded once at their centroid and that color stored in all of them
+void rasterMultisample(Screen& screen, const TriangleSetup& t){
+	float area = (t.B.x - t.A.x)*(t.C.y - t.A.y) - (t.C.x - t.A.x)*(t.B.y - t.A.y);
+	if(area == 0 || t.n.z == 0) return;
+	EdgeFunction edge[3] = {EdgeFunction(t.A, t.B, area), EdgeFunction(t.B, t.C, area), EdgeFunction(t.C, t.A, area)};
+	float color[3][3]; //Gouraud color planes
+	screenPlane(color[0], t.A, t.B, t.C, t.A.col.r, t.B.col.r, t.C.col.r);
+	screenPlane(color[1], t.A, t.B, t.C, t.A.col.g, t.B.col.g, t.C.col.g);
+	screenPlane(color[2], t.A, t.B, t.C, t.A.col.b, t.B.col.b, t.C.col.b);
+	//stored depth, as setPixel gets it, and its change from the pixel corner to every sample
+	float zx = t.n.x / t.n.z, zy = t.n.y / t.n.z, z0 = t.d / t.n.z;
+	float zOffset[MSAA_SAMPLES], eOffset[3][MSAA_SAMPLES], eLowest[3];
+	for(int s = 0; s < MSAA_SAMPLES; s++){
+		zOffset[s] = zx*MSAA_OFFSET[s][0] + zy*MSAA_OFFSET[s][1];
+		for(int k = 0; k < 3; k++)
+			eOffset[k][s] = edge[k].dx*MSAA_OFFSET[s][0] + edge[k].dy*MSAA_OFFSET[s][1];
+	}
+	for(int k = 0; k < 3; k++)
+		eLowest[k] = MIN(MIN(eOffset[k][0], eOffset[k][1]), MIN(eOffset[k][2], eOffset[k][3]));
+	//centroid of the samples of every mask
+	float centroid[1 << MSAA_SAMPLES][2];
+	for(unsigned int m = 1; m < 1 << MSAA_SAMPLES; m++){
+		int covered = 0;
+		centroid[m][0] = centroid[m][1] = 0;
+		for(int s = 0; s < MSAA_SAMPLES; s++)
+			if(m >> s & 1){
+				centroid[m][0] += MSAA_OFFSET[s][0]; centroid[m][1] += MSAA_OFFSET[s][1]; covered++;
+			}
+		centroid[m][0] /= covered; centroid[m][1] /= covered;
+	}
+	const unsigned int all = (1 << MSAA_SAMPLES) - 1;
+	const Texture* tex = t.texture;
+	int width = screen.width(), height = screen.height();
+	int yFirst = MAX(0, (int)floorf(t.A.y)), yLast = MIN(height - 1, (int)floorf(t.C.y));
+	for(int y = yFirst; y <= yLast; y++){
+		float lo, hi;
+		rowExtent(t, y, lo, hi);
+		if(lo > hi) continue;
+		int xFirst = MAX(0, (int)floorf(lo)), xLast = MIN(width - 1, (int)floorf(hi));
+		if(xFirst > xLast) continue;
+		int level = 0;
+		if(tex){
+			//one mip level for the row, chosen in its middle as shadedSpan does
+			float xm = (lo + hi) / 2, ym = y + 0.5f;
+			float q = t.q[0]*xm + t.q[1]*ym + t.q[2];
+			float u = (t.s[0]*xm + t.s[1]*ym + t.s[2]) / q, v = (t.t[0]*xm + t.t[1]*ym + t.t[2]) / q;
+			level = tex->levelOf((t.s[0] - u*t.q[0]) / q, (t.t[0] - v*t.q[0]) / q, (t.s[1] - u*t.q[1]) / q, (t.t[1] - v*t.q[1]) / q);
+		}
+		float e[3];
+		for(int k = 0; k < 3; k++)
+			e[k] = edge[k].c + edge[k].dx*xFirst + edge[k].dy*y;
+		float z = z0 + zx*xFirst + zy*y;
+		for(int x = xFirst; x <= xLast; x++, z += zx, e[0] += edge[0].dx, e[1] += edge[1].dx, e[2] += edge[2].dx){
+			unsigned int mask = 0;
+			if(e[0] + eLowest[0] > 0 && e[1] + eLowest[1] > 0 && e[2] + eLowest[2] > 0)
+				mask = all; //no edge passes through the samples
+			else
+				for(int s = 0; s < MSAA_SAMPLES; s++)
+					if(edge[0].inside(e[0] + eOffset[0][s]) && edge[1].inside(e[1] + eOffset[1][s]) && edge[2].inside(e[2] + eOffset[2][s]))
+						mask |= 1 << s;
+			if(mask == 0) continue;
+			float depth[MSAA_SAMPLES];
+			for(int s = 0; s < MSAA_SAMPLES; s++)
+				depth[s] = z + zOffset[s];
+			mask = screen.testSamples(x, y, mask, depth);
+			if(mask == 0) continue;
+			//the centroid of the covered samples lies inside the triangle, so the
+			//interpolated values there never overshoot those of the vertices
+			float cx = x + centroid[mask][0], cy = y + centroid[mask][1];
+			Color c(color[0][0]*cx + color[0][1]*cy + color[0][2], color[1][0]*cx + color[1][1]*cy + color[1][2], color[2][0]*cx + color[2][1]*cy + color[2][2]);
+			if(t.shadows) c = shadowedColor(t, c, cx, cy);
+			if(tex){
+				float q = t.q[0]*cx + t.q[1]*cy + t.q[2];
+				Color texel = tex->sample((t.s[0]*cx + t.s[1]*cy + t.s[2]) / q, (t.t[0]*cx + t.t[1]*cy + t.t[2]) / q, level);
+				c = Color(c.r*texel.r, c.g*texel.g, c.b*texel.b);
+			}
+			screen.writeSamples(x, y, mask, depth, packRGB(c));
+		}
+	}
+}
+
+//Gouraud fills a triangle prepared by setupTriangle
+void rasterTriangle(Screen& screen, const TriangleSetup& t){
+	if(!t.visible) return;
+	if(screen.multisampled()){
+		rasterMultisample(screen, t);
+		return;
+	}
+	ColorVertex S = t.A;
+	ColorVertex E = t.A;
+	//B lies right of the long edge A->C, also for a flat top where A->B has no slope
+	if (t.B.x > t.A.x + t.e2.dx*(t.B.y - t.A.y)){
+		fillSpans(screen, t, S, E, t.e2, t.e1, t.B.y);
+		E = edgeAt(t.B, t.e3, S.y);
+		fillSpans(screen, t, S, E, t.e2, t.e3, t.C.y);
+	}
+	else{
+		fillSpans(screen, t, S, E, t.e1, t.e2, t.B.y);
+		S = edgeAt(t.B, t.e3, E.y);
+		fillSpans(screen, t, S, E, t.e3, t.e2, t.C.y);
+	}
+}
+
+#endif
@@ -0,0 +1,503 @@
+#ifndef _RENDERSERVICE_H_
+#define _RENDERSERVICE_H_
+
+#include "Object.h"
+#include "Screen.h"
+#include "VertexColorHeader.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SERVICE_MAX_BATCH 16 //requests taken from the queue into one batched render
+#define SERVICE_MAX_SIZE 4096 //widest and tallest frame a request may ask for
+#define SERVICE_POOL_BYTES (512u << 20) //framebuffer memory kept idle between batches, and drawn into by one batch
+#define SERVICE_MAX_LINE 4096 //longest request line, a client sending more is dropped
+#define SERVICE_MAX_CLIENTS 64 //connections served at once, a client has at most one request queued
+
+//MSG_NOSIGNAL and MSG_MORE are Linux only, elsewhere SIGPIPE is turned off on each client
+//socket with SO_NOSIGPIPE and the reply line is not held back to go out with the frame
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+//a render service keeps its scenes loaded and answers requests from local clients over a unix socket
+//a client writes one request per line and reads one reply per request, in order
+//	RENDER <scene> <width>x<height> cam <x y z> look <x y z> [light <x y z> <r g b> [point]]... [msaa]
+//		replies "FRAME <bytes> <queued us> <rendered us>" and a newline, then a binary PPM of <bytes>
+//		without any light the scene's own lights are used, the whole scene has to lie in front of the camera
+//	STATS
+//		replies one line of queue depth, batch and latency counters
+//errors reply "ERROR <reason>" and the connection stays open
+//a client connecting while SERVICE_MAX_CLIENTS are served gets "ERROR too many clients" and is closed
+
+//one queued request, owned by the client thread that waits for it
+class RenderRequest
+{
+public:
+	std::string scene;
+	int width, height;
+	bool multisample;
+	Vertex3D cam, viewPlane;
+	std::vector<LightSource> lights;
+	std::chrono::steady_clock::time_point queued;
+	std::vector<unsigned char> frame; //the encoded PPM, or empty when the render failed
+	long long waited, rendered; //microseconds in the queue and in the batch
+	bool done;
+	RenderRequest():width(0), height(0), multisample(false), waited(0), rendered(0), done(false){}
+	bool sameView(const RenderRequest&) const;
+	~RenderRequest(){}
+};
+
+bool sameLights(const std::vector<LightSource>& a, const std::vector<LightSource>& b){
+	if(a.size() != b.size()) return false;
+	for(unsigned int i = 0; i < a.size(); i++)
+		if((a[i].pos - b[i].pos).magnitude() != 0 || a[i].type != b[i].type || a[i].Intensity.r != b[i].Intensity.r
+			|| a[i].Intensity.g != b[i].Intensity.g || a[i].Intensity.b != b[i].Intensity.b)
+			return false;
+	return true;
+}
+
+//whether both requests would get the very same frame
+bool RenderRequest::sameView(const RenderRequest& r) const{
+	return scene == r.scene && width == r.width && height == r.height && multisample == r.multisample
+		&& (cam - r.cam).magnitude() == 0 && (viewPlane - r.viewPlane).magnitude() == 0 && sameLights(lights, r.lights);
+}
+
+//reads a RENDER line into the request, returns the reason when it is malformed
+bool parseRenderRequest(const std::string& line, RenderRequest& r, std::string& error){
+	std::istringstream in(line);
+	std::string word, size;
+	in >> word >> r.scene >> size;
+	if(r.scene.empty() || sscanf(size.c_str(), "%dx%d", &r.width, &r.height) != 2){
+		error = "expected RENDER <scene> <width>x<height>";
+		return false;
+	}
+	if(r.width <= 0 || r.height <= 0 || r.width > SERVICE_MAX_SIZE || r.height > SERVICE_MAX_SIZE){
+		error = "frame size out of range";
+		return false;
+	}
+	bool cam = false, look = false;
+	while(in >> word){
+		if(word == "cam" && (in >> r.cam.x >> r.cam.y >> r.cam.z)) cam = true;
+		else if(word == "look" && (in >> r.viewPlane.x >> r.viewPlane.y >> r.viewPlane.z)) look = true;
+		else if(word == "light"){
+			Vertex3D pos;
+			Color intensity;
+			if(!(in >> pos.x >> pos.y >> pos.z >> intensity.r >> intensity.g >> intensity.b)){
+				error = "light needs a position and an intensity";
+				return false;
+			}
+			r.lights.push_back(LightSource(pos, intensity));
+		}
+		else if(word == "point" && !r.lights.empty()) r.lights.back().type = POINT_LIGHT;
+		else if(word == "msaa") r.multisample = true;
+		else{
+			error = "can't read " + word;
+			return false;
+		}
+	}
+	if(!cam || !look){
+		error = "cam and look are required";
+		return false;
+	}
+	//the view's up vector is the y axis, it can't be taken from a view along it
+	Vertex3D direction = r.viewPlane - r.cam;
+	if(direction.magnitude() == 0 || direction.crossProduct(Vertex3D(0, 1, 0)).magnitude() <= 1e-6f*direction.magnitude()){
+		error = "look has to be away from cam and not straight up or down";
+		return false;
+	}
+	return true;
+}
+
+//memory of an offscreen screen: the surface and depth buffer, and the samples when multisampled
+inline size_t screenBytes(int width, int height, bool multisample){
+	return (size_t)width*height*(sizeof(Uint32) + sizeof(float))
+		+ (multisample ? (size_t)width*height*MSAA_SAMPLES*(sizeof(Uint32) + sizeof(float)) : 0);
+}
+
+//offscreen framebuffers kept from batch to batch, only used by the render thread
+//a request finds a screen of its size again instead of allocating the surface and its buffers,
+//idle screens are cleared so that a batch can start drawing into them at once
+//the oldest idle screens are freed once together they take more than SERVICE_POOL_BYTES
+class ScreenPool
+{
+	std::vector<Screen*> idle; //oldest first
+	size_t idleBytes;
+	static size_t bytes(const Screen* s){ return screenBytes(s->width(), s->height(), s->multisampled()); }
+public:
+	ScreenPool():idleBytes(0){}
+	Screen* acquire(int width, int height, bool multisample){
+		for(unsigned int i = idle.size(); i-- > 0; )
+			if(idle[i]->width() == width && idle[i]->height() == height && idle[i]->multisampled() == multisample){
+				Screen* screen = idle[i];
+				idle.erase(idle.begin() + i);
+				idleBytes -= bytes(screen);
+				return screen;
+			}
+		Screen* screen = new Screen(width, height, true);
+		screen->setMultisample(multisample);
+		screen->clear();
+		return screen;
+	}
+	void release(Screen* screen){ //the screen has to be cleared already
+		idle.push_back(screen);
+		idleBytes += bytes(screen);
+		while(idleBytes > SERVICE_POOL_BYTES){
+			idleBytes -= bytes(idle.front());
+			delete idle.front();
+			idle.erase(idle.begin());
+		}
+	}
+	~ScreenPool(){
+		for(unsigned int i = 0; i < idle.size(); i++)
+			delete idle[i];
+	}
+};
+
+//what the STATS command reports
+class ServiceStats
+{
+public:
+	unsigned int queued, peakQueued; //requests waiting now, and the most that ever waited
+	unsigned int clients; //connections being served
+	unsigned long long requests, batches, views, failed; //views are the frames actually drawn
+	unsigned long long refused; //connections turned away over SERVICE_MAX_CLIENTS
+	long long waitTotal, waitMax, renderTotal, renderMax; //microseconds
+	ServiceStats():queued(0), peakQueued(0), clients(0), requests(0), batches(0), views(0), failed(0), refused(0),
+		waitTotal(0), waitMax(0), renderTotal(0), renderMax(0){}
+	~ServiceStats(){}
+};
+
+//a long lived renderer answering render requests from local clients
+//every client has a thread of its own that parses its requests and waits for them, a single render
+//thread takes the oldest request together with every queued one for the same scene and lights and
+//draws them as one batch with RenderObject::renderViews, requests for the very same view share a frame
+class RenderService
+{
+	class Scene{
+	public:
+		RenderObject* object;
+		std::vector<LightSource> lights;
+		bool owned;
+	};
+	std::map<std::string, Scene> scenes;
+	std::string path;
+	int listener;
+	std::deque<RenderRequest*> queue;
+	ServiceStats stats;
+	ScreenPool screens;
+	std::mutex lock;
+	std::condition_variable pending, finished;
+	void acceptLoop();
+	void serveClient(int);
+	bool reply(int, const std::string&, const std::vector<unsigned char>* = NULL);
+	bool admit();
+	std::string statsLine();
+	void renderBatch(std::vector<RenderRequest*>&);
+public:
+	RenderService():listener(-1){}
+	void addScene(const std::string&, RenderObject&, const std::vector<LightSource>&);
+	bool loadScene(const std::string&, const std::string&, const std::vector<LightSource>&);
+	bool open(const std::string&);
+	void run();
+	~RenderService();
+};
+
+RenderService::~RenderService(){
+	if(listener >= 0) unlink(path.c_str());
+	for(std::map<std::string, Scene>::iterator it = scenes.begin(); it != scenes.end(); ++it)
+		if(it->second.owned) delete it->second.object;
+}
+
+//serves an object that stays owned by the caller, scenes are added before open()
+void RenderService::addScene(const std::string& name, RenderObject& object, const std::vector<LightSource>& lights){
+	Scene scene = {&object, lights, false};
+	scenes[name] = scene;
+}
+
+//loads an OBJ file once and serves it under the name
+bool RenderService::loadScene(const std::string& name, const std::string& filename, const std::vector<LightSource>& lights){
+	RenderObject* object;
+	try{
+		object = new RenderObject(filename);
+	}
+	catch(...){
+		std::cout<<"Can't load the scene "<<name<<" from "<<filename<<".\n";
+		return false;
+	}
+	Scene scene = {object, lights, true};
+	scenes[name] = scene;
+	return true;
+}
+
+//binds the socket and starts accepting clients, requests are answered once run() is called
+bool RenderService::open(const std::string& socketPath){
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(socketPath.size() >= sizeof(address.sun_path)){
+		std::cout<<"Can't use the socket path "<<socketPath<<", it is too long.\n";
+		return false;
+	}
+	strcpy(address.sun_path, socketPath.c_str());
+	if((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+		std::cout<<"Can't create the socket.\n";
+		return false;
+	}
+	unlink(socketPath.c_str()); //left behind by an earlier run
+	if(bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0){
+		std::cout<<"Can't listen on "<<socketPath<<".\n";
+		close(listener);
+		listener = -1;
+		return false;
+	}
+	path = socketPath;
+	std::thread(&RenderService::acceptLoop, this).detach();
+	return true;
+}
+
+//takes clients until the listening socket fails, running out of descriptors or memory
+//only pauses it for a moment so that finishing clients can free some
+void RenderService::acceptLoop(){
+	while(true){
+		int client = accept(listener, NULL, NULL);
+		if(client >= 0){
+#ifdef SO_NOSIGPIPE
+			int on = 1;
+			setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+			if(admit())
+				std::thread(&RenderService::serveClient, this, client).detach();
+			else{
+				reply(client, "ERROR too many clients\n");
+				close(client);
+			}
+			continue;
+		}
+		if(errno == EINTR || errno == ECONNABORTED) continue;
+		if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			continue;
+		}
+		std::cout<<"Can't accept more clients on "<<path<<".\n";
+		return;
+	}
+}
+
+//counts a new client in, false when SERVICE_MAX_CLIENTS are already served
+bool RenderService::admit(){
+	std::lock_guard<std::mutex> guard(lock);
+	if(stats.clients >= SERVICE_MAX_CLIENTS){
+		stats.refused++;
+		return false;
+	}
+	stats.clients++;
+	return true;
+}
+
+//sends everything or fails, a client that went away only ends its own thread
+bool sendAll(int client, const void* data, size_t size, int flags = 0){
+	const char* p = (const char*)data;
+	while(size > 0){
+		ssize_t n = send(client, p, size, flags | MSG_NOSIGNAL);
+		if(n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+//sends a reply line and the frame after it, the frame is not copied into the reply
+bool RenderService::reply(int client, const std::string& line, const std::vector<unsigned char>* frame){
+	if(!frame || frame->empty()) return sendAll(client, line.data(), line.size());
+	return sendAll(client, line.data(), line.size(), MSG_MORE) && sendAll(client, &(*frame)[0], frame->size());
+}
+
+//reads the requests of one client, queues every RENDER and waits for its frame before the next line
+void RenderService::serveClient(int client){
+	std::string buffer;
+	char chunk[1024];
+	bool connected = true;
+	while(connected){
+		size_t newline = buffer.find('\n');
+		if(newline == std::string::npos){
+			ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+			if(n <= 0 || buffer.size() > SERVICE_MAX_LINE) break;
+			buffer.append(chunk, n);
+			continue;
+		}
+		std::string line = buffer.substr(0, newline);
+		buffer.erase(0, newline + 1);
+		if(!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+		std::string command = line.substr(0, line.find(' '));
+
+		if(command.empty()) continue;
+		if(command == "STATS"){
+			connected = reply(client, statsLine());
+			continue;
+		}
+		if(command != "RENDER"){
+			connected = reply(client, "ERROR unknown command " + command + "\n");
+			continue;
+		}
+		RenderRequest request;
+		std::string error;
+		if(!parseRenderRequest(line, request, error)){
+			connected = reply(client, "ERROR " + error + "\n");
+			continue;
+		}
+		std::map<std::string, Scene>::const_iterator scene = scenes.find(request.scene);
+		if(scene == scenes.end()){
+			connected = reply(client, "ERROR no scene " + request.scene + "\n");
+			continue;
+		}
+		if(scene->second.object->nearestDepth(request.cam, request.viewPlane) < NEAR_DISTANCE){
+			connected = reply(client, "ERROR the scene has to be in front of the camera\n");
+			continue;
+		}
+		if(request.lights.empty()) request.lights = scene->second.lights;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			request.queued = std::chrono::steady_clock::now();
+			queue.push_back(&request);
+			stats.queued = queue.size();
+			stats.peakQueued = MAX(stats.peakQueued, stats.queued);
+			pending.notify_one();
+			finished.wait(guard, [&request]{ return request.done; });
+		}
+		if(request.frame.empty()){
+			connected = reply(client, "ERROR can't render the frame\n");
+			continue;
+		}
+		char header[64];
+		sprintf(header, "FRAME %u %lld %lld\n", (unsigned int)request.frame.size(), request.waited, request.rendered);
+		connected = reply(client, header, &request.frame);
+	}
+	close(client);
+	std::lock_guard<std::mutex> guard(lock);
+	stats.clients--;
+}
+
+std::string RenderService::statsLine(){
+	std::lock_guard<std::mutex> guard(lock);
+	unsigned long long served = MAX(stats.requests, 1ull), batches = MAX(stats.batches, 1ull);
+	char line[512];
+	snprintf(line, sizeof(line), "STATS clients %u refused %llu queued %u peak %u requests %llu batches %llu views %llu failed %llu "
+		"wait_us avg %lld max %lld render_us avg %lld max %lld\n",
+		stats.clients, stats.refused, stats.queued, stats.peakQueued, stats.requests, stats.batches, stats.views, stats.failed,
+		stats.waitTotal / (long long)served, stats.waitMax, stats.renderTotal / (long long)batches, stats.renderMax);
+	return line;
+}
+
+//the render loop, it never returns
+void RenderService::run(){
+	std::vector<RenderRequest*> batch;
+	while(true){
+		std::unique_lock<std::mutex> guard(lock);
+		pending.wait(guard, [this]{ return !queue.empty(); });
+		//the oldest request leads, the rest of the queue is searched for requests that can share its frame
+		//the batch's screens together stay within SERVICE_POOL_BYTES, a larger request is drawn alone
+		batch.assign(1, queue.front());
+		queue.pop_front();
+		size_t batchBytes = screenBytes(batch[0]->width, batch[0]->height, batch[0]->multisample);
+		for(std::deque<RenderRequest*>::iterator it = queue.begin(); it != queue.end() && batch.size() < SERVICE_MAX_BATCH; ){
+			size_t bytes = screenBytes((*it)->width, (*it)->height, (*it)->multisample);
+			if((*it)->scene == batch[0]->scene && sameLights((*it)->lights, batch[0]->lights)
+				&& batchBytes + bytes <= SERVICE_POOL_BYTES){
+				batch.push_back(*it);
+				batchBytes += bytes;
+				it = queue.erase(it);
+			}
+			else ++it;
+		}
+		stats.queued = queue.size();
+		guard.unlock();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		renderBatch(batch);
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		long long rendered = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+		guard.lock();
+		stats.batches++;
+		stats.renderTotal += rendered;
+		stats.renderMax = MAX(stats.renderMax, rendered);
+		for(unsigned int i = 0; i < batch.size(); i++){
+			RenderRequest& r = *batch[i];
+			r.waited = std::chrono::duration_cast<std::chrono::microseconds>(start - r.queued).count();
+			r.rendered = rendered;
+			r.done = true;
+			stats.requests++;
+			stats.waitTotal += r.waited;
+			stats.waitMax = MAX(stats.waitMax, r.waited);
+			if(r.frame.empty()) stats.failed++;
+		}
+		guard.unlock();
+		finished.notify_all();
+	}
+}
+
+//draws every distinct view of the batch in one renderViews call and encodes the frames,
+//requests for a view already in the batch get a copy of its frame
+void RenderService::renderBatch(std::vector<RenderRequest*>& batch){
+	std::vector<View> views;
+	std::vector<int> viewOf(batch.size()); //view drawn for each request, -1 when it has no screen
+	std::vector<unsigned int> first; //request that owns each view
+	for(unsigned int i = 0; i < batch.size(); i++){
+		viewOf[i] = -1;
+		for(unsigned int v = 0; v < first.size(); v++)
+			if(batch[i]->sameView(*batch[first[v]])){
+				viewOf[i] = v;
+				break;
+			}
+		if(viewOf[i] >= 0) continue;
+		Screen* screen = screens.acquire(batch[i]->width, batch[i]->height, batch[i]->multisample);
+		if(screen->width() == 0){
+			delete screen;
+			continue;
+		}
+		viewOf[i] = views.size();
+		views.push_back(View(batch[i]->cam, batch[i]->viewPlane, screen));
+		first.push_back(i);
+	}
+	//every frame is encoded and its screen cleared for the pool right after it is drawn, while
+	//the screen is still in the cache, instead of in a pass over the whole batch afterwards
+	if(!views.empty()){
+		RenderObject& object = *scenes.find(batch[0]->scene)->second.object;
+		object.renderViews(views, batch[0]->lights, [&](unsigned int v){
+			RenderRequest& r = *batch[first[v]];
+			char header[32];
+			int n = sprintf(header, "P6\n%d %d\n255\n", r.width, r.height);
+			r.frame.resize(n + (size_t)r.width*r.height*3);
+			memcpy(&r.frame[0], header, n);
+			views[v].screen->readRGB(&r.frame[n]);
+			views[v].screen->clear();
+		});
+	}
+	for(unsigned int v = 0; v < views.size(); v++)
+		screens.release(views[v].screen);
+	for(unsigned int i = 0; i < batch.size(); i++)
+		if(viewOf[i] >= 0 && first[viewOf[i]] != i)
+			batch[i]->frame = batch[first[viewOf[i]]]->frame;
+	std::lock_guard<std::mutex> guard(lock);
+	stats.views += views.size();
+}
+
+#endif
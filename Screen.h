@@ -3,43 +3,206 @@
 
 #include "VertexColorHeader.h"
 #include <SDL.h>
+#include <algorithm>
+#include <vector>
+
+#define MSAA_SAMPLES 4 //depth and color samples per pixel while multisampling, the resolve is written for 4
+#define BACKGROUND 0xdadada //color the screen is cleared to
+
+//sample positions inside a pixel, on a rotated grid so that edges close to horizontal
+//and close to vertical both pass through four different sample rows or columns
+const float MSAA_OFFSET[MSAA_SAMPLES][2] = {{0.375f, 0.125f}, {0.875f, 0.375f}, {0.125f, 0.625f}, {0.625f, 0.875f}};
+
+//packs a color into 0x00RRGGBB, components clamped to [0, 1]
+inline Uint32 packRGB(const Color& c){
+	Uint32 r = 255*MAX(0, MIN(1, c.r)), g = 255*MAX(0, MIN(1, c.g)), b = 255*MAX(0, MIN(1, c.b));
+	return (r << 16) | (g << 8) | b;
+}
 
 class Screen
 {
 	SDL_Surface* screen; //SDL_Surface
+	//the window's surface when it has to be locked for pixel access, as hardware surfaces do:
+	//frames are then drawn into screen, a software surface, and blitted to it on refresh
+	SDL_Surface* display;
 	float* zBuffer; //Z-buffer to detect visible surface (pixel)
+	bool offscreen; //drawn into a memory surface instead of the window
+	//multisampling keeps MSAA_SAMPLES depths and colors per pixel, row by row, and the
+	//surface only receives their average when the frame is resolved
+	float* sampleDepth;
+	Uint32* sampleColor; //0x00RRGGBB
+	void resolveRow(int, Uint32*) const;
 public:
-	Screen(const int, const int);
+	Screen(const int, const int, bool = false, bool = false);
+	int width() const {return screen ? screen->w : 0;}
+	int height() const {return screen ? screen->h : 0;}
+	bool multisampled() const {return sampleDepth != NULL;}
 	void clear();
+	void readRGB(unsigned char*) const;
 	void refresh();
+	void resolve();
+	void setMultisample(bool);
+	bool visible(int, int, float) const;
 	void setPixel(Vertex3D, Color);
 	void setPixel(int, int, float, Color);
 	void setPixel(int, int, int, Uint32);
+	unsigned int testSamples(int, int, unsigned int, const float*) const;
+	void writeSamples(int, int, unsigned int, const float*, Uint32);
 	~Screen(){
-		if(screen){
+		if(screen && (offscreen || display)){
 			SDL_FreeSurface(screen);
 			screen = NULL;
 		}
 		delete[] zBuffer;
+		delete[] sampleDepth;
+		delete[] sampleColor;
 	}
 };
 
-Screen::Screen(const int width, const int height){
-	if((SDL_Init(SDL_INIT_EVERYTHING)) == -1) return; //initialize SDL
-	if((screen = SDL_SetVideoMode(width, height, 32, SDL_SWSURFACE | SDL_RESIZABLE)) == NULL) return; //set sdl videomode in software buffer and make it resizable
+Screen::Screen(const int width, const int height, bool memory, bool vsync):screen(NULL), display(NULL), zBuffer(NULL), offscreen(memory),
+	sampleDepth(NULL), sampleColor(NULL){
+	if(offscreen){
+		//a 32 bit surface not tied to the window, for rendering without a display
+		if((screen = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0xff0000, 0xff00, 0xff, 0)) == NULL) return;
+	}
+	else{
+		if((SDL_Init(SDL_INIT_EVERYTHING)) == -1) return; //initialize SDL
+		//set sdl videomode in software buffer and make it resizable
+		//a double buffered hardware surface lets SDL_Flip wait for the vertical retrace where the driver supports it
+		Uint32 flags = vsync ? SDL_HWSURFACE | SDL_DOUBLEBUF | SDL_RESIZABLE : SDL_SWSURFACE | SDL_RESIZABLE;
+		if((screen = SDL_SetVideoMode(width, height, 32, flags)) == NULL) return;
+		if(SDL_MUSTLOCK(screen)){
+			display = screen;
+			if((screen = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, display->format->Rmask,
+				display->format->Gmask, display->format->Bmask, 0)) == NULL) return;
+		}
+	}
 	zBuffer = new float [width*height];
 	for (int i = 0; i < width*height; i++)
 		zBuffer[i] = 0;
 }
 
-//clear the whole screen
+//clear the whole screen, a multisampled one only clears its samples as the resolve
+//overwrites every pixel of the surface
 void Screen::clear(){
-	SDL_FillRect(screen, &screen->clip_rect, 0xdadada);
+	if (multisampled()){
+		std::fill(sampleDepth, sampleDepth + screen->w*screen->h*MSAA_SAMPLES, 0.0f);
+		std::fill(sampleColor, sampleColor + screen->w*screen->h*MSAA_SAMPLES, (Uint32)BACKGROUND);
+		return;
+	}
+	SDL_FillRect(screen, &screen->clip_rect, BACKGROUND);
+	for (int i = 0; i < screen->w*screen->h; i++)
+		zBuffer[i] = 0;
 }
 
-//refresh the screen
+//turns multisampling on or off, the samples start out cleared
+void Screen::setMultisample(bool on){
+	if (on == multisampled() || screen == NULL)
+		return;
+	delete[] sampleDepth;
+	delete[] sampleColor;
+	sampleDepth = NULL;
+	sampleColor = NULL;
+	if (on){
+		sampleDepth = new float [screen->w*screen->h*MSAA_SAMPLES];
+		sampleColor = new Uint32 [screen->w*screen->h*MSAA_SAMPLES];
+	}
+	clear();
+}
+
+//averages the samples of every pixel of a row into 0x00RRGGBB colors
+//pixels away from any edge hold one color in all samples and are copied
+void Screen::resolveRow(int yy, Uint32* out) const{
+	const Uint32* c = sampleColor + yy*screen->w*MSAA_SAMPLES;
+	for (int x = 0; x < screen->w; x++, c += MSAA_SAMPLES){
+		if (c[0] == c[1] && c[0] == c[2] && c[0] == c[3]){
+			out[x] = c[0];
+			continue;
+		}
+		Uint32 rb = 0, g = 0;
+		for (int s = 0; s < MSAA_SAMPLES; s++){
+			rb += c[s] & 0xff00ff; g += c[s] & 0xff00;
+		}
+		out[x] = (((rb + 0x20002) >> 2) & 0xff00ff) | (((g + 0x200) >> 2) & 0xff00);
+	}
+}
+
+//writes the average of every pixel's samples to the surface
+void Screen::resolve(){
+	if (!multisampled())
+		return;
+	std::vector<Uint32> resolved(screen->w);
+	for (int y = 0; y < screen->h; y++){
+		Uint32* row = (Uint32*)((Uint8*)screen->pixels + y*screen->pitch);
+		resolveRow(y, &resolved[0]);
+		for (int x = 0; x < screen->w; x++)
+			row[x] = SDL_MapRGB(screen->format, resolved[x] >> 16, (resolved[x] >> 8) & 0xff, resolved[x] & 0xff);
+	}
+}
+
+//copies the pixels out as packed 8 bit RGB, row by row from the top
+//a multisampled screen is read from its samples, resolved or not
+void Screen::readRGB(unsigned char* rgb) const{
+	std::vector<Uint32> resolved(multisampled() ? screen->w : 0);
+	for (int y = 0; y < screen->h; y++){
+		if (multisampled()){
+			resolveRow(y, &resolved[0]);
+			for (int x = 0; x < screen->w; x++, rgb += 3){
+				rgb[0] = resolved[x] >> 16; rgb[1] = (resolved[x] >> 8) & 0xff; rgb[2] = resolved[x] & 0xff;
+			}
+			continue;
+		}
+		Uint32* row = (Uint32*)((Uint8*)screen->pixels + y*screen->pitch);
+		for (int x = 0; x < screen->w; x++, rgb += 3)
+			SDL_GetRGB(row[x], screen->format, rgb, rgb + 1, rgb + 2);
+	}
+}
+
+//refresh the screen, resolving the samples first
 void Screen::refresh(){
-	SDL_Flip(screen);
+	resolve();
+	if(offscreen)
+		return;
+	if(display){
+		SDL_BlitSurface(screen, NULL, display, NULL); //locks the window's surface itself
+		SDL_Flip(display);
+	}
+	else
+		SDL_Flip(screen);
+}
+
+//whether a pixel at this depth would pass the depth test, to skip shading hidden ones
+bool Screen::visible(int xx, int yy, float depth) const{
+	int width = screen->w, height = screen->h;
+	if (xx < 0 || xx >= width || yy < 0 || yy >= height)
+		return false;
+	if (multisampled()){
+		float d[MSAA_SAMPLES];
+		for (int s = 0; s < MSAA_SAMPLES; s++)
+			d[s] = depth;
+		return testSamples(xx, yy, (1 << MSAA_SAMPLES) - 1, d) != 0;
+	}
+	return depth <= zBuffer[xx * height + yy];
+}
+
+//the samples of mask at which the depths given for each sample pass the depth test
+unsigned int Screen::testSamples(int xx, int yy, unsigned int mask, const float* depth) const{
+	const float* z = sampleDepth + (yy*screen->w + xx)*MSAA_SAMPLES;
+	unsigned int pass = 0;
+	for (int s = 0; s < MSAA_SAMPLES; s++)
+		if ((mask >> s & 1) && depth[s] <= z[s])
+			pass |= 1 << s;
+	return pass;
+}
+
+//stores the color and depths in the samples of mask, which have passed testSamples
+void Screen::writeSamples(int xx, int yy, unsigned int mask, const float* depth, Uint32 color){
+	int base = (yy*screen->w + xx)*MSAA_SAMPLES;
+	for (int s = 0; s < MSAA_SAMPLES; s++)
+		if (mask >> s & 1){
+			sampleDepth[base + s] = depth[s];
+			sampleColor[base + s] = color;
+		}
 }
 
 //pixel plot function with pixel as 3D vertex
@@ -54,6 +217,14 @@ void Screen::setPixel(int xx, int yy, float depth, Color c = {0xff, 0xff, 0xff,
     xx=ROUNDOFF(xx); yy=ROUNDOFF(yy);
     if (xx < 0 || xx >= width || yy < 0 || yy >= height)
 		return;
+	if (multisampled()){
+		//covers the whole pixel
+		float d[MSAA_SAMPLES];
+		for (int s = 0; s < MSAA_SAMPLES; s++)
+			d[s] = depth;
+		writeSamples(xx, yy, testSamples(xx, yy, (1 << MSAA_SAMPLES) - 1, d), d, packRGB(c));
+		return;
+	}
 	if (depth > zBuffer[xx * height + yy])
 		return;
 	zBuffer[xx * height + yy] = depth;
@@ -68,6 +239,15 @@ void Screen::setPixel(int xx, int yy, int depth, Uint32 color){
     xx=ROUNDOFF(xx); yy=ROUNDOFF(yy);
     if (xx < 0 || xx >= width || yy < 0 || yy >= height)
 		return;
+	if (multisampled()){
+		Uint8 r, g, b;
+		float d[MSAA_SAMPLES];
+		SDL_GetRGB(color, screen->format, &r, &g, &b);
+		for (int s = 0; s < MSAA_SAMPLES; s++)
+			d[s] = depth;
+		writeSamples(xx, yy, testSamples(xx, yy, (1 << MSAA_SAMPLES) - 1, d), d, (r << 16) | (g << 8) | b);
+		return;
+	}
 	if (depth > zBuffer[xx * height + yy])
 		return;
 	zBuffer[xx * height + yy] = depth;
@@ -76,4 +256,4 @@ void Screen::setPixel(int xx, int yy, int depth, Uint32 color){
     *pixmem32 = color;
 }
 
-#endif
+#endif
@@ -0,0 +1,186 @@
+#ifndef _SHADOWMAP_H_
+#define _SHADOWMAP_H_
+
+#include "ThreadPool.h"
+#include "VertexColorHeader.h"
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#define SHADOW_MAP_SIZE 1024 //texels along each side of a shadow map
+#define MAX_SHADOW_LIGHTS 2 //lights tested per pixel, further lights cast no shadows
+#define SHADOW_BIAS 1.5f //depth offset against self shadowing, in texel footprints
+#define SHADOW_SLOPE_BIAS 2.0f //further offset of a triangle in the map, in texels of its own depth slope
+#define SHADOW_MAX_ANGLE 75 //widest half angle of a point light's frustum, in degrees
+
+//depth only fill of a triangle into a size x size buffer, keeping the nearest value at every texel
+//vertices are (x, y, value) in texels where value is linear on the map: the depth itself, or
+//1/depth when inverse is set; there is no color, no clipping in depth and nothing but the depth loop
+//every triangle is pushed away from the light by SHADOW_SLOPE_BIAS texels of its slope, so that
+//surfaces at a grazing angle to the light do not shadow themselves between neighbouring texels
+void rasterDepth(float* buffer, int size, Vertex3D a, Vertex3D b, Vertex3D c, bool inverse){
+	if(b.y < a.y) std::swap(a, b);
+	if(c.y < a.y) std::swap(a, c);
+	if(c.y < b.y) std::swap(b, c);
+	float det = (b.x - a.x)*(c.y - a.y) - (c.x - a.x)*(b.y - a.y);
+	if(det == 0) return;
+	float dzdx = ((b.z - a.z)*(c.y - a.y) - (c.z - a.z)*(b.y - a.y)) / det;
+	float dzdy = ((c.z - a.z)*(b.x - a.x) - (b.z - a.z)*(c.x - a.x)) / det;
+	float offset = SHADOW_SLOPE_BIAS * (fabsf(dzdx) + fabsf(dzdy));
+	if(inverse) offset = -offset; //1/depth falls with the distance
+
+	//texel centres at y + 0.5 between the top and bottom vertex
+	int y0 = MAX(0, (int)ceilf(a.y - 0.5f)), y1 = MIN(size, (int)ceilf(c.y - 0.5f));
+	float longSlope = (c.x - a.x) / (c.y - a.y);
+	for(int y = y0; y < y1; y++){
+		float py = y + 0.5f;
+		float xLong = a.x + longSlope*(py - a.y);
+		float xShort = py < b.y ? a.x + (b.x - a.x)*(py - a.y)/(b.y - a.y)
+			: b.x + (c.x - b.x)*(py - b.y)/(c.y - b.y);
+		float xl = MIN(xLong, xShort), xr = MAX(xLong, xShort);
+		int x0 = MAX(0, (int)ceilf(xl - 0.5f)), x1 = MIN(size, (int)ceilf(xr - 0.5f));
+		if(x0 >= x1) continue;
+		float z = a.z + dzdx*(x0 + 0.5f - a.x) + dzdy*(py - a.y) + offset;
+		float* row = buffer + y*size;
+		if(inverse){
+			for(int x = x0; x < x1; x++, z += dzdx){
+				float depth = 1 / z;
+				if(depth < row[x]) row[x] = depth;
+			}
+		}
+		else{
+			for(int x = x0; x < x1; x++, z += dzdx)
+				if(z < row[x]) row[x] = z;
+		}
+	}
+}
+
+//distance to the nearest surface seen from a light, one texel per direction
+//a directional light looks along -pos with an orthographic map fitted around the mesh,
+//a point light looks from pos towards the centre of the mesh with a perspective map
+//the map is only rendered again when the light, the map size or the geometry version change
+class ShadowMap
+{
+	int size;
+	std::vector<float> depth;
+	bool perspective;
+	float xRow[4], yRow[4], wRow[4], zRow[4]; //world to texel x, y, homogeneous w and depth
+	float texelSize; //world size of a texel at unit depth (perspective) or anywhere (orthographic)
+	//what the map was rendered for
+	Vertex3D lightPos;
+	LightType lightType;
+	unsigned int version;
+	bool valid;
+	void fit(const std::vector<Vertex3D>&, const LightSource&);
+public:
+	ShadowMap():size(0), perspective(false), texelSize(0), lightType(DIRECTIONAL_LIGHT), version(0), valid(false){}
+	bool update(const std::vector<Vertex3D>&, const std::vector<Vertex3D>&, const LightSource&, unsigned int, int = SHADOW_MAP_SIZE);
+	//homogeneous texel coordinates x, y, w and the depth of a world point, linear in the point
+	void transform(const Vertex3D& p, float* out) const{
+		out[0] = xRow[0]*p.x + xRow[1]*p.y + xRow[2]*p.z + xRow[3];
+		out[1] = yRow[0]*p.x + yRow[1]*p.y + yRow[2]*p.z + yRow[3];
+		out[2] = wRow[0]*p.x + wRow[1]*p.y + wRow[2]*p.z + wRow[3];
+		out[3] = zRow[0]*p.x + zRow[1]*p.y + zRow[2]*p.z + zRow[3];
+	}
+	float visibility(float, float, float) const;
+	~ShadowMap(){}
+};
+
+//chooses the light's frame so that the whole mesh falls inside the map
+void ShadowMap::fit(const std::vector<Vertex3D>& position, const LightSource& light){
+	Vertex3D lo = position[0], hi = position[0];
+	for(unsigned int i = 1; i < position.size(); i++){
+		lo = Vertex3D(MIN(lo.x, position[i].x), MIN(lo.y, position[i].y), MIN(lo.z, position[i].z));
+		hi = Vertex3D(MAX(hi.x, position[i].x), MAX(hi.y, position[i].y), MAX(hi.z, position[i].z));
+	}
+	Vertex3D centre = (lo + hi) / 2;
+	float radius = MAX((hi - lo).magnitude() / 2, 1e-3f);
+	perspective = light.type == POINT_LIGHT;
+	Vertex3D forward = perspective ? centre - light.pos : light.pos * -1;
+	if(forward.magnitude() == 0) forward = Vertex3D(0, -1, 0);
+	forward.normalize();
+	Vertex3D up = fabs(forward.y) < 0.99f ? Vertex3D(0, 1, 0) : Vertex3D(1, 0, 0);
+	Vertex3D right = forward.crossProduct(up).normalized();
+	up = right.crossProduct(forward);
+
+	if(!perspective){
+		//a square of the bounding sphere's diameter across, depth measured from its near side
+		float half = radius * (1 + 2.0f/size); //a texel of margin
+		float scale = size / (2*half);
+		Vertex3D o = centre - forward*radius;
+		float xr[4] = {right.x*scale, right.y*scale, right.z*scale, size/2.0f - right.dotProduct(centre)*scale};
+		float yr[4] = {-up.x*scale, -up.y*scale, -up.z*scale, size/2.0f + up.dotProduct(centre)*scale};
+		float wr[4] = {0, 0, 0, 1};
+		float zr[4] = {forward.x, forward.y, forward.z, -forward.dotProduct(o)};
+		memcpy(xRow, xr, sizeof(xr)); memcpy(yRow, yr, sizeof(yr)); memcpy(wRow, wr, sizeof(wr)); memcpy(zRow, zr, sizeof(zr));
+		texelSize = 1 / scale;
+		return;
+	}
+	//a frustum around the bounding sphere, no wider than SHADOW_MAX_ANGLE
+	float distance = (centre - light.pos).magnitude();
+	float angle = distance > radius ? asin(radius / distance) : RADIAN(SHADOW_MAX_ANGLE);
+	float tangent = tan(MIN(angle, (float)RADIAN(SHADOW_MAX_ANGLE)));
+	float focal = size / (2*tangent); //texels per unit of x/depth
+	const Vertex3D& o = light.pos;
+	float xr[4] = {right.x*focal + forward.x*size/2, right.y*focal + forward.y*size/2, right.z*focal + forward.z*size/2, 0};
+	float yr[4] = {-up.x*focal + forward.x*size/2, -up.y*focal + forward.y*size/2, -up.z*focal + forward.z*size/2, 0};
+	float zr[4] = {forward.x, forward.y, forward.z, -forward.dotProduct(o)};
+	xr[3] = -(xr[0]*o.x + xr[1]*o.y + xr[2]*o.z);
+	yr[3] = -(yr[0]*o.x + yr[1]*o.y + yr[2]*o.z);
+	memcpy(xRow, xr, sizeof(xr)); memcpy(yRow, yr, sizeof(yr)); memcpy(wRow, zr, sizeof(zr)); memcpy(zRow, zr, sizeof(zr));
+	texelSize = 1 / focal;
+}
+
+//renders the map for the light unless it is up to date, returns whether it was rendered
+//surfaces hold 1-based vertex indices as in the OBJ file
+bool ShadowMap::update(const std::vector<Vertex3D>& position, const std::vector<Vertex3D>& surfaceVertex,
+	const LightSource& light, unsigned int geometryVersion, int mapSize){
+	if(valid && version == geometryVersion && size == mapSize && lightType == light.type
+		&& (lightPos - light.pos).magnitude() == 0)
+		return false;
+	valid = true;
+	version = geometryVersion;
+	size = mapSize;
+	lightType = light.type;
+	lightPos = light.pos;
+	depth.assign(size*size, 1e30f);
+	if(position.empty()) return true;
+	fit(position, light);
+
+	//vertices to texel space in parallel, then one depth-only pass over the triangles
+	std::vector<Vertex3D> texel(position.size());
+	ThreadPool::instance().parallelFor(0, position.size(), 4096, [&](unsigned int begin, unsigned int end){
+		for(unsigned int i = begin; i < end; i++){
+			float h[4];
+			transform(position[i], h);
+			if(!perspective) texel[i] = Vertex3D(h[0], h[1], h[3]);
+			else if(h[2] > 1e-4f) texel[i] = Vertex3D(h[0]/h[2], h[1]/h[2], 1/h[3]);
+			else texel[i] = Vertex3D(0, 0, -1); //behind the light
+		}
+	});
+	for(unsigned int f = 0; f < surfaceVertex.size(); f++){
+		const Vertex3D& a = texel[(int)surfaceVertex[f].x - 1];
+		const Vertex3D& b = texel[(int)surfaceVertex[f].y - 1];
+		const Vertex3D& c = texel[(int)surfaceVertex[f].z - 1];
+		if(perspective && (a.z <= 0 || b.z <= 0 || c.z <= 0)) continue;
+		rasterDepth(&depth[0], size, a, b, c, perspective);
+	}
+	return true;
+}
+
+//fraction of the 2x2 texels around (x, y) that see a point at distance d from the light
+//points outside the map are lit
+float ShadowMap::visibility(float x, float y, float d) const{
+	if(!valid || d <= 0) return 1;
+	float bias = SHADOW_BIAS * texelSize * (perspective ? d : 1);
+	int x0 = (int)floorf(x - 0.5f), y0 = (int)floorf(y - 0.5f);
+	float lit = 0;
+	for(int j = 0; j < 2; j++)
+		for(int i = 0; i < 2; i++){
+			int tx = x0 + i, ty = y0 + j;
+			if(tx < 0 || ty < 0 || tx >= size || ty >= size || d - bias <= depth[ty*size + tx]) lit += 0.25f;
+		}
+	return lit;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef _TEXTURE_H_
+#define _TEXTURE_H_
+
+#include "VertexColorHeader.h"
+#include <SDL.h>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define TEXTURE_TILE 4 //texels are stored in 4x4 tiles, 64 bytes each, one cache line
+
+//one level of the mip chain, power of two sized
+//tiles are stored row by row and the texels of a tile in Morton order, so that the
+//2x2 neighbourhood of a bilinear fetch nearly always lies in one cache line
+class MipLevel
+{
+public:
+	int width, height, tilesPerRow;
+	std::vector<Uint32> texels; //0x00RRGGBB
+	MipLevel():width(0), height(0), tilesPerRow(0){}
+	MipLevel(int w, int h):width(w), height(h), tilesPerRow((w + TEXTURE_TILE - 1) / TEXTURE_TILE),
+		texels(tilesPerRow * ((h + TEXTURE_TILE - 1) / TEXTURE_TILE) * TEXTURE_TILE*TEXTURE_TILE, 0){}
+	//position of texel (x, y) in the tiled storage
+	unsigned int offset(int x, int y) const{
+		unsigned int inTile = (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+		return ((y >> 2)*tilesPerRow + (x >> 2))*TEXTURE_TILE*TEXTURE_TILE + inTile;
+	}
+	Uint32 texel(int x, int y) const {return texels[offset(x, y)];}
+	~MipLevel(){}
+};
+
+//mipmapped RGB texture sampled with repeating coordinates, (0, 0) is the top left corner
+class Texture
+{
+	std::vector<MipLevel> levels; //levels[0] is the full size image, each next one half of it
+	void buildMipChain();
+public:
+	Texture(){}
+	Texture(const unsigned char*, int, int);
+	bool load(const std::string&);
+	bool empty() const {return levels.empty();}
+	int width() const {return levels.empty() ? 0 : levels[0].width;}
+	int height() const {return levels.empty() ? 0 : levels[0].height;}
+	int mipLevels() const {return levels.size();}
+	int levelOf(float, float, float, float) const;
+	Color sample(float, float, int) const;
+	~Texture(){}
+};
+
+//smallest power of two not below n
+inline int powerOfTwo(int n){
+	int p = 1;
+	while(p < n) p <<= 1;
+	return p;
+}
+
+//builds the texture from packed 8 bit RGB rows, top row first
+//sizes that are not powers of two are stretched up to the next one
+Texture::Texture(const unsigned char* rgb, int w, int h){
+	if(rgb == NULL || w <= 0 || h <= 0) return;
+	MipLevel base(powerOfTwo(w), powerOfTwo(h));
+	for(int y = 0; y < base.height; y++)
+		for(int x = 0; x < base.width; x++){
+			const unsigned char* p = rgb + 3*((y*h/base.height)*w + x*w/base.width);
+			base.texels[base.offset(x, y)] = (p[0] << 16) | (p[1] << 8) | p[2];
+		}
+	levels.push_back(base);
+	buildMipChain();
+}
+
+//reads a BMP file, a missing or unreadable image leaves the texture empty
+bool Texture::load(const std::string& filename){
+	SDL_Surface* image = SDL_LoadBMP(filename.c_str());
+	if(image == NULL){
+		std::cout<<"Can't open the texture "<<filename<<".\n";
+		return false;
+	}
+	std::vector<unsigned char> rgb(3*image->w*image->h);
+	int bpp = image->format->BytesPerPixel;
+	if(SDL_MUSTLOCK(image)) SDL_LockSurface(image);
+	for(int y = 0; y < image->h; y++)
+		for(int x = 0; x < image->w; x++){
+			Uint8* p = (Uint8*)image->pixels + y*image->pitch + x*bpp;
+			Uint32 pixel;
+			if(bpp == 1) pixel = *p;
+			else if(bpp == 2) pixel = *(Uint16*)p;
+			else if(bpp == 3){
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+				pixel = (p[0] << 16) | (p[1] << 8) | p[2];
+#else
+				pixel = p[0] | (p[1] << 8) | (p[2] << 16);
+#endif
+			}
+			else pixel = *(Uint32*)p;
+			unsigned char* out = &rgb[3*(y*image->w + x)];
+			SDL_GetRGB(pixel, image->format, out, out + 1, out + 2);
+		}
+	if(SDL_MUSTLOCK(image)) SDL_UnlockSurface(image);
+	*this = Texture(&rgb[0], image->w, image->h);
+	SDL_FreeSurface(image);
+	return true;
+}
+
+//box filters every level down to 1x1
+void Texture::buildMipChain(){
+	while(levels.back().width > 1 || levels.back().height > 1){
+		const MipLevel& src = levels.back();
+		MipLevel dst(MAX(1, src.width / 2), MAX(1, src.height / 2));
+		int sx = src.width > 1 ? 1 : 0, sy = src.height > 1 ? 1 : 0; //a side of length 1 is not halved
+		for(int y = 0; y < dst.height; y++)
+			for(int x = 0; x < dst.width; x++){
+				Uint32 t[4] = {src.texel(2*x, 2*y), src.texel(2*x + sx, 2*y), src.texel(2*x, 2*y + sy), src.texel(2*x + sx, 2*y + sy)};
+				Uint32 r = 0, g = 0, b = 0;
+				for(int k = 0; k < 4; k++){
+					r += (t[k] >> 16) & 0xff; g += (t[k] >> 8) & 0xff; b += t[k] & 0xff;
+				}
+				dst.texels[dst.offset(x, y)] = (((r + 2) / 4) << 16) | (((g + 2) / 4) << 8) | ((b + 2) / 4);
+			}
+		levels.push_back(dst);
+	}
+}
+
+//mip level whose texels are about one pixel apart, from the change of the
+//texture coordinates over one pixel step in x and in y
+int Texture::levelOf(float dudx, float dvdx, float dudy, float dvdy) const{
+	dudx *= width(); dudy *= width();
+	dvdx *= height(); dvdy *= height();
+	float texels = sqrtf(MAX(dudx*dudx + dvdx*dvdx, dudy*dudy + dvdy*dvdy));
+	if(!(texels > 1)) return 0; //magnified, or nan on a degenerate span
+	return MIN((int)levels.size() - 1, (int)log2f(texels));
+}
+
+//bilinear sample of one level, coordinates repeat outside [0, 1)
+Color Texture::sample(float u, float v, int level) const{
+	const MipLevel& m = levels[level];
+	float x = u*m.width - 0.5f, y = v*m.height - 0.5f;
+	float fx = floorf(x), fy = floorf(y);
+	float ax = x - fx, ay = y - fy;
+	int x0 = (int)fx & (m.width - 1), y0 = (int)fy & (m.height - 1);
+	int x1 = (x0 + 1) & (m.width - 1), y1 = (y0 + 1) & (m.height - 1);
+	Uint32 t00 = m.texel(x0, y0), t10 = m.texel(x1, y0), t01 = m.texel(x0, y1), t11 = m.texel(x1, y1);
+	float w00 = (1 - ax)*(1 - ay), w10 = ax*(1 - ay), w01 = (1 - ax)*ay, w11 = ax*ay;
+	return Color(
+		(w00*((t00 >> 16) & 0xff) + w10*((t10 >> 16) & 0xff) + w01*((t01 >> 16) & 0xff) + w11*((t11 >> 16) & 0xff)) / 255,
+		(w00*((t00 >> 8) & 0xff) + w10*((t10 >> 8) & 0xff) + w01*((t01 >> 8) & 0xff) + w11*((t11 >> 8) & 0xff)) / 255,
+		(w00*(t00 & 0xff) + w10*(t10 & 0xff) + w01*(t01 & 0xff) + w11*(t11 & 0xff)) / 255
+		);
+}
+
+#endif
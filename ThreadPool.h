@@ -0,0 +1,255 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define WAIT_SPINS 64 //times a waiter with nothing to run yields before it sleeps
+
+//counts the unfinished tasks submitted through it, wait() on the pool until it drops to zero
+//the first exception thrown by one of its tasks is kept and rethrown by wait()
+class TaskGroup
+{
+	std::atomic<int> pending;
+	std::atomic<bool> error;
+	std::exception_ptr exception;
+	std::mutex errorLock;
+	friend class ThreadPool;
+public:
+	TaskGroup():pending(0), error(false){}
+	bool done() const {return pending.load() == 0;}
+	bool failed() const {return error.load();}
+	~TaskGroup(){}
+};
+
+//work-stealing task scheduler shared by the whole renderer
+//every worker owns a deque, pops its newest task and steals the oldest task of the others
+//threads waiting on a group run queued tasks instead of blocking, so jobs may nest, and only
+//sleep once there has been nothing to run for a while
+class ThreadPool
+{
+	struct Task{
+		std::function<void()> run;
+		TaskGroup* group;
+	};
+	struct Queue{
+		std::deque<Task> tasks;
+		std::mutex lock;
+	};
+	std::vector<std::thread> threads;
+	std::vector<Queue*> queues; //one per worker, the last one takes tasks from other threads
+	std::atomic<int> queued; //tasks waiting in any queue
+	std::atomic<unsigned int> nextQueue; //round robin target for submissions
+	std::mutex sleepLock;
+	std::condition_variable wake, finished; //workers sleep on wake, waiters on finished
+	std::atomic<int> sleepers; //waiters asleep on finished, tasks only signal it while there are some
+	bool stop;
+	static thread_local int workerIndex; //queue owned by the current thread, -1 outside the pool
+
+	bool pop(int, Task&, bool = false);
+	bool steal(int, Task&);
+	void execute(Task&);
+	void notifyWaiters();
+	void workerLoop(int);
+public:
+	ThreadPool(unsigned int = std::thread::hardware_concurrency());
+	static ThreadPool& instance();
+	unsigned int size() const {return threads.size() + 1;} //workers plus the calling thread
+	void run(TaskGroup&, const std::function<void()>&);
+	bool runPending(bool = false);
+	void wait(TaskGroup&);
+	void waitUntil(const std::function<bool()>&, bool = false);
+	void parallelFor(unsigned int, unsigned int, unsigned int, const std::function<void(unsigned int, unsigned int)>&);
+	~ThreadPool();
+};
+
+thread_local int ThreadPool::workerIndex = -1;
+
+//starts one worker less than the hardware threads, the thread waiting on a job is the last one
+ThreadPool::ThreadPool(unsigned int hardware):queued(0), nextQueue(0), sleepers(0), stop(false){
+	unsigned int workers = hardware > 1 ? hardware - 1 : 0;
+	for (unsigned int i = 0; i <= workers; i++)
+		queues.push_back(new Queue);
+	for (unsigned int i = 0; i < workers; i++)
+		threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+	for (unsigned int i = 0; i < queues.size(); i++)
+		delete queues[i];
+}
+
+//the scheduler used by the vertex pipeline
+ThreadPool& ThreadPool::instance(){
+	static ThreadPool pool;
+	return pool;
+}
+
+//next task of the given queue: newest for a worker's own deque unless oldest is set, oldest for the shared one
+bool ThreadPool::pop(int q, Task& task, bool oldest){
+	std::lock_guard<std::mutex> guard(queues[q]->lock);
+	if (queues[q]->tasks.empty())
+		return false;
+	if (q == workerIndex && !oldest){
+		task = queues[q]->tasks.back();
+		queues[q]->tasks.pop_back();
+	}else{
+		task = queues[q]->tasks.front();
+		queues[q]->tasks.pop_front();
+	}
+	queued--;
+	return true;
+}
+
+//oldest task of any queue other than the given one
+bool ThreadPool::steal(int self, Task& task){
+	int n = queues.size();
+	for (int k = 1; k <= n; k++){
+		int q = (self + k) % n;
+		if (q == self) continue;
+		std::lock_guard<std::mutex> guard(queues[q]->lock);
+		if (queues[q]->tasks.empty()) continue;
+		task = queues[q]->tasks.front();
+		queues[q]->tasks.pop_front();
+		queued--;
+		return true;
+	}
+	return false;
+}
+
+//runs the task and counts it off its group even when it throws
+void ThreadPool::execute(Task& task){
+	try{
+		task.run();
+	}catch(...){
+		std::lock_guard<std::mutex> guard(task.group->errorLock);
+		if (!task.group->error){
+			task.group->exception = std::current_exception();
+			task.group->error = true;
+		}
+	}
+	task.group->pending--;
+	notifyWaiters();
+}
+
+//wakes the waiters asleep in waitUntil so they look at their condition and the queues again
+//the check of sleepers follows the change they wait for, a waiter going to sleep either is
+//counted already or still sees the change when it checks its condition under sleepLock
+void ThreadPool::notifyWaiters(){
+	if (sleepers.load() == 0)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+	}
+	finished.notify_all();
+}
+
+void ThreadPool::workerLoop(int index){
+	workerIndex = index;
+	Task task;
+	while (true){
+		if (pop(index, task) || steal(index, task)){
+			execute(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(sleepLock);
+		wake.wait(guard, [this]{ return stop || queued.load() > 0; });
+		if (stop) return;
+	}
+}
+
+//queues a task, a worker pushes onto its own deque, other threads spread tasks round robin
+void ThreadPool::run(TaskGroup& group, const std::function<void()>& fn){
+	group.pending++;
+	if (threads.empty()){
+		Task task = {fn, &group};
+		execute(task);
+		return;
+	}
+	int q = workerIndex >= 0 ? workerIndex : nextQueue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> guard(queues[q]->lock);
+		queues[q]->tasks.push_back({fn, &group});
+		queued++;
+	}
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+	}
+	wake.notify_one();
+	notifyWaiters();
+}
+
+//runs one queued task on the calling thread, returns false if there was nothing to do
+//oldest takes the thread's own tasks in the order they were queued, for a caller that needs
+//the results of its tasks in that order
+bool ThreadPool::runPending(bool oldest){
+	Task task;
+	int self = workerIndex >= 0 ? workerIndex : queues.size() - 1;
+	if (!pop(self, task, oldest) && !steal(self, task))
+		return false;
+	execute(task);
+	return true;
+}
+
+//helps with queued tasks until every task of the group has finished, then rethrows what a task threw
+void ThreadPool::wait(TaskGroup& group){
+	waitUntil([&group]{ return group.done(); });
+	if (group.failed())
+		std::rethrow_exception(group.exception);
+}
+
+//helps with queued tasks until done() holds, oldest is passed on to runPending
+//after WAIT_SPINS tries without anything to run the thread sleeps until a task finishes or is queued,
+//done() has to turn true through a task of the pool
+void ThreadPool::waitUntil(const std::function<bool()>& done, bool oldest){
+	int idle = 0;
+	while (!done()){
+		if (runPending(oldest)){
+			idle = 0;
+			continue;
+		}
+		if (++idle < WAIT_SPINS){
+			std::this_thread::yield();
+			continue;
+		}
+		sleepers++;
+		{
+			std::unique_lock<std::mutex> guard(sleepLock);
+			finished.wait(guard, [this, &done]{ return done() || queued.load() > 0; });
+		}
+		sleepers--;
+		idle = 0;
+	}
+}
+
+//calls fn(begin, end) on chunks of at most grain items, in parallel, and returns when all are done
+void ThreadPool::parallelFor(unsigned int first, unsigned int last, unsigned int grain, const std::function<void(unsigned int, unsigned int)>& fn){
+	if (last <= first) return;
+	grain = std::max(grain, 1u);
+	if (threads.empty() || last - first <= grain){
+		fn(first, last);
+		return;
+	}
+	TaskGroup group;
+	for (unsigned int begin = first; begin < last; begin += grain){
+		unsigned int end = std::min(last, begin + grain);
+		run(group, [&fn, begin, end]{ fn(begin, end); });
+	}
+	wait(group);
+}
+
+#endif
@@ -1,9 +1,12 @@
-#ifndef VERTEXCOLORHEADER_H_INCLUDED
+#ifndef VERTEXCOLORHEADER_H_INCLUDED
 #define VERTEXCOLORHEADER_H_INCLUDED
 
 #include <cmath>
-#include <iostream>
+#include <iostream>
 #include <string.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #define ABS(a) ((a < 0) ? -a : a) //absolute value
 #define DEGREE(a) (a * 180 / PI) //equivalent angle in degree for its radian value
@@ -15,6 +18,16 @@
 #define RADIAN(a) (a * PI / 180) //equivalent radian value for provided degree angle
 #define ROUNDOFF(a) ((int)((a < 0) ? (a - 0.5) : (a + 0.5))) //gives the nearest integer value of float
 
+#ifdef __SSE__
+//1/sqrt(x) of 4 floats refined by one Newton-Raphson step, zero length vectors stay zero
+static inline __m128 rsqrt4(__m128 x){
+	x = _mm_max_ps(x, _mm_set1_ps(1e-20f));
+	__m128 y = _mm_rsqrt_ps(x);
+	__m128 half = _mm_mul_ps(_mm_set1_ps(0.5f), x);
+	return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(half, _mm_mul_ps(y, y))));
+}
+#endif
+
 //color class
 class Color
 {
@@ -29,7 +42,7 @@ public:
 //3D vertex with z coordinate included
 class Vertex3D
 {
-public:
+public:
     Vertex3D():x(0), y(0), z(0){}
 	Vertex3D(float xx, float yy, float zz):x(xx), y(yy), z(zz){}
 	Vertex3D crossProduct (const Vertex3D) const; //a x b
@@ -40,12 +53,12 @@ public:
 	float cosine(const Vertex3D&) const; //costheta between two vectors
 	float dotProduct (const Vertex3D) const; //a . b
 	float magnitude() const; //|a|
-	Vertex3D normalized();
+	Vertex3D normalized() const;
 	void normalize();
 	float x, y, z;
 	~Vertex3D(){} //destructor
 };
-Vertex3D Vertex3D::normalized(){
+Vertex3D Vertex3D::normalized() const{
 	float m = magnitude();
 	if (EQUAL(m, 0.0))
 		return {0, 0, 0};
@@ -81,11 +94,26 @@ float Vertex3D::magnitude() const{
 	return sqrt(x*x + y*y + z*z);
 }
 
+//half line from origin along direction, hits farther than tMax are ignored
+class Ray
+{
+public:
+	Vertex3D origin, direction;
+	float tMax;
+	Ray():tMax(1e30f){}
+	Ray(Vertex3D o, Vertex3D d, float t = 1e30f):origin(o), direction(d), tMax(t){}
+	~Ray(){}
+};
+
+//a point light shines from pos, a directional light shines along -pos
+enum LightType{ POINT_LIGHT, DIRECTIONAL_LIGHT };
+
 class LightSource{
 public:
 	Color Intensity;
 	Vertex3D pos;
-	LightSource(Vertex3D v, Color c):pos(v), Intensity(c){}
+	LightType type;
+	LightSource(Vertex3D v, Color c, LightType t = DIRECTIONAL_LIGHT):Intensity(c), pos(v), type(t){}
 	~LightSource(){}
 };
 
@@ -100,8 +128,8 @@ public:
 	ColorVertex(Vertex3D v, Color c):x(v.x), y(v.y), z(v.z), col(c){}
 	~ColorVertex(){}
 
-};
-
+};
+
 class Matrix
 {
 private:
@@ -139,7 +167,7 @@ public:
 	Matrix operator* (const Matrix&) const; //returns this * mat (cross-product)
 	Matrix operator+ (const Matrix&) const; //returns this + mat
 	Matrix operator- (const Matrix&) const; //returns this - mat
-	Vertex3D operator* (Vertex3D); //returns (*this) * Vertex3D (a new Vertex3D)
+	Vertex3D operator* (Vertex3D) const; //returns (*this) * Vertex3D (a new Vertex3D)
 	const float& operator() (int) const; //returns value at Matrix(pos) = Matrix.data(pos)
 	const float& operator() (int, int) const; //returns value of Matrix(r, c)
 	float& operator() (int); //returns the value of Matrix(pos) = Matrix.data[pos]
@@ -199,7 +227,12 @@ Matrix Matrix::operator- (const Matrix& mat) const{
 	return res;
 }
 
-Vertex3D Matrix::operator*(Vertex3D v){
+Vertex3D Matrix::operator*(Vertex3D v) const{
+	if(row == 4 && col == 4) //affine transforms are applied without temporaries
+		return Vertex3D(
+			data[0]*v.x + data[1]*v.y + data[2]*v.z + data[3],
+			data[4]*v.x + data[5]*v.y + data[6]*v.z + data[7],
+			data[8]*v.x + data[9]*v.y + data[10]*v.z + data[11]);
 	Matrix temp({4,1});
 	temp.init(v.x, v.y, v.z, 1);
 	temp = (*this) * temp;
@@ -251,6 +284,6 @@ void Matrix::operator= (const Matrix& mat){
 	col = mat.col;
 	memcpy(data, mat.data, row*col*sizeof(float));
 }
-
-
-#endif // VERTEXCOLORHEADER_H_INCLUDED
+
+
+#endif // VERTEXCOLORHEADER_H_INCLUDED
@@ -1,42 +1,212 @@
+#include "Animation.h"
+#include "FrameWriter.h"
 #include "Object.h"
+#ifndef _WIN32
+#include "RenderService.h"
+#endif
 #include "Transformation.h"
 #include <SDL.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define TICK_MS 16 //length of a simulation step, key controls move the scene once per tick
+#define MAX_TICKS_PER_FRAME 5 //ticks caught up at most after a long frame
+
+//usage: jpt [--export <frame_%04d.ppm|frame_%04d.png|out.yuv|"|command">]
+//           [--script <animation>] [--frames <n>] [--size <width>x<height>]
+//           [--fps <cap, 0 for none>] [--vsync 1] [--optimize 1] [--shadows 1] [--msaa 1]
+//           [--texture <material>:<image.bmp>]...
+//           [--serve <socket> [--scene <name>:<model.obj>]...]
+//without --export the pitch is shown in a window, redrawn only while something changes,
+//clicking on it prints the triangle under the mouse
+//--serve keeps the pitch, as scene "pitch", and any further scenes loaded and answers render
+//requests on a unix socket until the process is stopped, see RenderService.h for the protocol
+
+//window events, returns through the flags what the main loop has to do
+void handleEvent(const SDL_Event& event, bool& quit, bool& redraw, int& width, int& height){
+    if(event.type == SDL_QUIT) quit = true;
+    if(event.type == SDL_VIDEORESIZE){
+        width = event.resize.w;  height = event.resize.h;
+    }
+    if(event.type == SDL_VIDEOEXPOSE) redraw = true;
+}
+
+//prints the surface under the mouse when a button is pressed
+void handleClick(const SDL_Event& event, const RenderObject& pitch, const Vertex3D& cam, const Vertex3D& view, int width, int height){
+    if(event.type != SDL_MOUSEBUTTONDOWN) return;
+    RayHit hit;
+    if(pitch.pick(screenRay(event.button.x + 0.5f, event.button.y + 0.5f, cam, view, width, height), &hit) >= 0)
+        std::cout<<"Picked triangle "<<hit.triangle<<" at distance "<<hit.t<<".\n";
+}
+
+static const int controlKeys[] = {SDLK_LEFT, SDLK_RIGHT, SDLK_UP, SDLK_DOWN, SDLK_c, SDLK_v, SDLK_l, SDLK_k,
+    SDLK_t, SDLK_a, SDLK_d, SDLK_s, SDLK_w, SDLK_z, SDLK_x};
+
+//whether any key that moves the scene is held down
+bool inputHeld(const Uint8* keys){
+    for(unsigned int i = 0; i < sizeof(controlKeys)/sizeof(controlKeys[0]); i++)
+        if(keys[controlKeys[i]]) return true;
+    return false;
+}
+
+//one simulation tick of keyboard control, returns whether the model changed
+bool applyInput(const Uint8* keys, RenderObject& pitch, Vertex3D& cam){
+    bool changed = inputHeld(keys);
+    if (keys[SDLK_LEFT]) pitch.rotate(RADIAN(0), RADIAN(0), RADIAN(-2));
+    if (keys[SDLK_RIGHT]) pitch.rotate(RADIAN(0), RADIAN(0), RADIAN(2));
+    if (keys[SDLK_UP]) pitch.rotate(RADIAN(2), RADIAN(0), RADIAN(0));
+    if (keys[SDLK_DOWN]) pitch.rotate(RADIAN(-2), RADIAN(0), RADIAN(0));
+    if(keys[SDLK_c]) pitch.rotate(RADIAN(0), RADIAN(2), RADIAN(0));
+    if(keys[SDLK_v]) pitch.rotate(RADIAN(0), RADIAN(-2), RADIAN(0));
+    if(keys[SDLK_l]) pitch.scale(1.5);
+    if(keys[SDLK_k]) pitch.scale(0.75);
+    if(keys[SDLK_t]) pitch.translate({1.0,1.0,1.0});
+    if(keys[SDLK_a]) cam.x -= 4;
+    if(keys[SDLK_d]) cam.x += 4;
+    if(keys[SDLK_s]) cam.y -= 4;
+    if(keys[SDLK_w]) cam.y += 4;
+    if(keys[SDLK_z]) cam.z += 4;
+    if(keys[SDLK_x]) cam.z -= 4;
+    return changed;
+}
 
 int main( int argc, char *argv[]){
     int SCREEN_WIDTH = 800, SCREEN_HEIGHT = 600;
     bool quit = false;
-    Vertex3D cam(0, 0, 20), viewPlane(0,0,0);
-	LightSource light({0, 100, 0},{1, 0, 0});
-    Vertex3D camcopy = cam;
+    Vertex3D cam(0, 0, 20), viewPlane(0,0,0);
+	std::vector<LightSource> lights;
+	lights.push_back(LightSource({0, 100, 0}, {1, 0, 0}, DIRECTIONAL_LIGHT));
     SDL_Event event;
     RenderObject pitch("cricket.obj");
-    while(!quit){
-        while(SDL_PollEvent(&event)){
-            if(event.type == SDL_QUIT) quit = true;
-            if(event.type == SDL_VIDEORESIZE){
-                SCREEN_WIDTH = event.resize.w;  SCREEN_HEIGHT = event.resize.h;
+    //cricket.obj has no material library, its parts are consecutive vertex ranges
+    pitch.assignMaterial(0, 8, Material("pitch", {0.5, 0.5, 0.5}, {0.5, 0.5, 0.5}, {0.1, 0.1, 0.1}, {0, 1, 0}));
+    pitch.assignMaterial(8, 390, Material("ball", {0.5, 0.5, 0.5}, {0.5, 0.5, 0.5}, {0.1, 0.1, 0.1}, {1, 0, 0}));
+    pitch.assignMaterial(390, 0xffffffff, Material("stumps", {0.5, 0.5, 0.5}, {0.5, 0.5, 0.5}, {0.1, 0.1, 0.1}, {0, 0, 1}));
+
+    std::string exportTarget, scriptFile, servePath;
+    std::vector<std::string> extraScenes;
+    int exportFrames = 360, frameCap = 60;
+    bool vsync = false, optimize = false, msaa = false;
+    for(int i = 1; i + 1 < argc; i += 2){
+        if(!strcmp(argv[i], "--export")) exportTarget = argv[i+1];
+        else if(!strcmp(argv[i], "--script")) scriptFile = argv[i+1];
+        else if(!strcmp(argv[i], "--frames")) exportFrames = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "--fps")) frameCap = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "--vsync")) vsync = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "--optimize")) optimize = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "--shadows")) pitch.setShadows(atoi(argv[i+1]) != 0);
+        else if(!strcmp(argv[i], "--msaa")) msaa = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "--serve")) servePath = argv[i+1];
+        else if(!strcmp(argv[i], "--scene")) extraScenes.push_back(argv[i+1]);
+        else if(!strcmp(argv[i], "--size")) sscanf(argv[i+1], "%dx%d", &SCREEN_WIDTH, &SCREEN_HEIGHT);
+        else if(!strcmp(argv[i], "--texture")){ //pitch, ball or stumps, e.g. pitch:grass.bmp
+            std::string arg = argv[i+1];
+            size_t colon = arg.find(':');
+            if(colon != std::string::npos)
+                pitch.setTexture(arg.substr(0, colon), arg.substr(colon + 1));
+        }
+    }
+    if(optimize){
+        MeshStats before, after;
+        pitch.optimizeMeshLayout(&before, &after);
+        std::cout<<"Vertex cache misses per triangle "<<before.acmr<<" -> "<<after.acmr
+            <<", vertex lines fetched per triangle "<<before.lineMisses<<" -> "<<after.lineMisses<<".\n";
+    }
+#ifndef _WIN32
+    if(!servePath.empty()){
+        RenderService service;
+        service.addScene("pitch", pitch, lights);
+        for(unsigned int i = 0; i < extraScenes.size(); i++){
+            size_t colon = extraScenes[i].find(':');
+            if(colon != std::string::npos)
+                service.loadScene(extraScenes[i].substr(0, colon), extraScenes[i].substr(colon + 1), lights);
+        }
+        if(!service.open(servePath)) return 1;
+        std::cout<<"Serving frames on "<<servePath<<"."<<std::endl;
+        service.run();
+        return 0;
+    }
+#endif
+    if(!exportTarget.empty()){
+        try{
+            AnimationScript script;
+            if(!scriptFile.empty())
+                script = AnimationScript(scriptFile);
+            else{ //turntable around the vertical axis
+                AnimationSegment turn(exportFrames);
+                turn.ops.push_back(AnimationOp("rotate", {0, 360.0f/exportFrames, 0}));
+                script.add(turn);
             }
+            FrameWriter writer(exportTarget, frameFormatOf(exportTarget), SCREEN_WIDTH, SCREEN_HEIGHT);
+            renderSequence(pitch, script, writer, cam, viewPlane, lights, SCREEN_WIDTH, SCREEN_HEIGHT, msaa);
+            if(!writer.ok()) return 1; //the writer has said which frame failed
+            std::cout<<writer.frames()<<" frames written, renderer waited on the writer "<<writer.waits()<<" times.\n";
+            return 0;
+        }
+        catch(const char*){ //the script or the writer has said what went wrong
+            return 1;
         }
+    }
+
+    //the simulation advances in fixed ticks, rendering interpolates the camera between the last two
+    Screen* window = new Screen(SCREEN_WIDTH, SCREEN_HEIGHT, false, vsync);
+    window->setMultisample(msaa);
+    SDL_WM_SetCaption("Cricket Pitch", NULL);
+    Vertex3D previousCam = cam, drawnCam = cam;
+    Uint32 previous = SDL_GetTicks(), lag = 0, lastFrame = 0;
+    bool redraw = true;
+    while(!quit){
         Uint8* keys = SDL_GetKeyState(0);
-        if (keys[SDLK_LEFT]) pitch.rotate(RADIAN(0), RADIAN(0), RADIAN(-2),light);
-        if (keys[SDLK_RIGHT]) pitch.rotate(RADIAN(0), RADIAN(0), RADIAN(2),light);
-        if (keys[SDLK_UP]) pitch.rotate(RADIAN(2), RADIAN(0), RADIAN(0),light);
-        if (keys[SDLK_DOWN]) pitch.rotate(RADIAN(-2), RADIAN(0), RADIAN(0),light);
-        if(keys[SDLK_c]) pitch.rotate(RADIAN(0), RADIAN(2), RADIAN(0),light);
-        if(keys[SDLK_v]) pitch.rotate(RADIAN(0), RADIAN(-2), RADIAN(0),light);
-        if(keys[SDLK_l]) pitch.scale(1.5);
-        if(keys[SDLK_k]) pitch.scale(0.75);
-        if(keys[SDLK_t]) pitch.translate({1.0,1.0,1.0});
-        if(keys[SDLK_a]) cam.x -= 4;
-        if(keys[SDLK_d]) cam.x += 4;
-        if(keys[SDLK_s]) cam.y -= 4;
-        if(keys[SDLK_w]) cam.y += 4;
-        if(keys[SDLK_z]) cam.z += 4;
-        if(keys[SDLK_x]) cam.z -= 4;
-
-        pitch.gouraudFill(SCREEN_WIDTH, SCREEN_HEIGHT, cam, viewPlane,light);
+        //nothing moves and the last frame is up to date: sleep until the next event
+        if(!redraw && !inputHeld(keys) && (cam - drawnCam).magnitude() == 0){
+            if(SDL_WaitEvent(&event)){
+                handleEvent(event, quit, redraw, SCREEN_WIDTH, SCREEN_HEIGHT);
+                handleClick(event, pitch, drawnCam, viewPlane, window->width(), window->height());
+            }
+            previous = SDL_GetTicks();
+            lag = 0;
+        }
+        while(SDL_PollEvent(&event)){
+            handleEvent(event, quit, redraw, SCREEN_WIDTH, SCREEN_HEIGHT);
+            handleClick(event, pitch, drawnCam, viewPlane, window->width(), window->height());
+        }
+        if(quit) break;
+        if(SCREEN_WIDTH != window->width() || SCREEN_HEIGHT != window->height()){
+            delete window;
+            window = new Screen(SCREEN_WIDTH, SCREEN_HEIGHT, false, vsync);
+            window->setMultisample(msaa);
+            redraw = true;
+        }
 
+        Uint32 now = SDL_GetTicks();
+        lag = MIN(lag + now - previous, (Uint32)(MAX_TICKS_PER_FRAME*TICK_MS)); //don't spiral after a stall
+        previous = now;
+        while(lag >= TICK_MS){
+            previousCam = cam;
+            if(applyInput(keys, pitch, cam))
+                redraw = true;
+            lag -= TICK_MS;
+        }
+
+        Vertex3D drawCam = previousCam + (cam - previousCam)*((float)lag / TICK_MS);
+        if(!redraw && (drawCam - drawnCam).magnitude() == 0){
+            SDL_Delay(TICK_MS - lag); //keys are held but the next tick is not due yet
+            continue;
+        }
+        if(frameCap > 0){ //wait out the rest of the frame period
+            Uint32 elapsed = SDL_GetTicks() - lastFrame;
+            if(elapsed < 1000u/frameCap)
+                SDL_Delay(1000u/frameCap - elapsed);
+        }
+        lastFrame = SDL_GetTicks();
+        window->clear();
+        pitch.gouraudFill(*window, drawCam, viewPlane, lights);
+        window->refresh();
+        drawnCam = drawCam;
+        redraw = false;
     }
+    delete window;
     SDL_Quit();
     return 0;
 }
@@ -1,15 +1,15 @@
-#ifndef PROJECTION_H_INCLUDED
-#define PROJECTION_H_INCLUDED
-
+#ifndef PROJECTION_H_INCLUDED
+#define PROJECTION_H_INCLUDED
+
 #ifndef _PERSPECTIVE_H_
 #define _PERSPECTIVE_H_
 
 #include "Transformation.h"
 #include "VertexColorHeader.h"
 
-//changes 3D vertex into corresponding plotable 2D vertex
-Vertex3D perspective(const Vertex3D& source, const Vertex3D& cam,
-    const Vertex3D& view, float n, float f, int width, int height){
+//gives the matrix taking a world vertex to device coordinates (before the divide by w)
+Matrix viewingTransform(const Vertex3D& cam, const Vertex3D& view,
+    float n, float f, int width, int height){
 
     // For perspective transformation
     float ang = 120; // some view angle
@@ -64,22 +64,45 @@ Vertex3D perspective(const Vertex3D& source, const Vertex3D& cam,
             );
 
 
-    Matrix transformer = todevice * perspective * lookAt;
-
-    Matrix copy({4, 1});
-    copy.init(source.x, source.y, source.z, 1);
+    return todevice * perspective * lookAt;
+}
 
-    copy = transformer*copy;
+//changes 3D vertex into corresponding plotable 2D vertex using a viewing transform
+//computing the transform once per frame instead of once per vertex
+//the homogeneous w divided out is handed back for perspective-correct interpolation
+inline Vertex3D project(const Matrix& transformer, const Vertex3D& source, float* clipW = NULL){
+    const float* m = transformer.data;
+    float w = m[12]*source.x + m[13]*source.y + m[14]*source.z + m[15];
+    if(clipW) *clipW = w;
+    return Vertex3D(
+            (m[0]*source.x + m[1]*source.y + m[2]*source.z + m[3]) / w,
+            (m[4]*source.x + m[5]*source.y + m[6]*source.z + m[7]) / w,
+            (m[8]*source.x + m[9]*source.y + m[10]*source.z + m[11]) / w
+            );
+}
 
-    Vertex3D res;
-    res.x = copy(0) / copy(3);
-    res.y = copy(1) / copy(3);
-    res.z = copy(2) / copy(3);
+//ray from the camera through pixel (x, y), the inverse of viewingTransform for picking
+Ray screenRay(float x, float y, const Vertex3D& cam, const Vertex3D& view, int width, int height){
+    float ang = 120; // same view angle as viewingTransform
+    float ratio = (float)width/height;
+    float tangent = std::tan( RADIAN(ang/2) );
+    Vertex3D vup(0,1,0);
+    Vertex3D nn = (cam - view).normalized();
+    Vertex3D u = (nn.crossProduct(vup)).normalized();
+    Vertex3D v = (u.crossProduct(nn)).normalized();
+    // eye space point at unit distance in front of the camera
+    float xe = (x - width/2.0f) * tangent / width;
+    float ye = -(y - height/2.0f) * tangent / (height * ratio);
+    return Ray(cam, (u*xe + v*ye - nn).normalized());
+}
 
-    return res;//return 2D equivalent vertex of the 3D source vertex
+//changes 3D vertex into corresponding plotable 2D vertex
+Vertex3D perspective(const Vertex3D& source, const Vertex3D& cam,
+    const Vertex3D& view, float n, float f, int width, int height){
+    return project(viewingTransform(cam, view, n, f, width, height), source);//return 2D equivalent vertex of the 3D source vertex
 }
 
 #endif
-
-
-#endif // PROJECTION_H_INCLUDED
+
+
+#endif // PROJECTION_H_INCLUDED